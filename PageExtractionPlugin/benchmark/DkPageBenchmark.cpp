@@ -0,0 +1,335 @@
+/*******************************************************************************************************
+ DkPageBenchmark.cpp
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2015 Markus Diem
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+
+#include "DkSyntheticPage.h"
+#include "DkPageSegmentation.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrentMap>
+
+#include <opencv2/core/core.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <vector>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+// QString::SkipEmptyParts is deprecated since Qt 5.14
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+static const Qt::SplitBehavior skipEmptyParts = Qt::SkipEmptyParts;
+#else
+static const QString::SplitBehavior skipEmptyParts = QString::SkipEmptyParts;
+#endif
+
+struct DkBenchmarkResult {
+	int idx = 0;		// image
+	double time = 0;	// [ms]
+	double iou = 0;
+	DkSegmentationStats stats;
+};
+
+double jaccardIndex(const DkPolyRect& gt, const DkPolyRect& computed) {
+
+	if (computed.empty())
+		return 0.0;
+
+	double inter = std::abs(gt.intersectArea(computed));
+	double uni = gt.getAreaConst() + computed.getAreaConst() - inter;
+
+	return uni > 0 ? inter/uni : 0.0;
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+
+	if (sorted.empty())
+		return 0.0;
+
+	int idx = (int)std::ceil(p*sorted.size()) - 1;
+	return sorted[std::max(0, std::min(idx, (int)sorted.size()-1))];
+}
+
+/**
+* Segments the image the way DkPageExtractionPlugin::runPlugin does: the segmentation
+* wraps the QImage's buffer and grayscale sources are planned as a single channel.
+* The tracking, background, cache and journal modes depend on the batch and are not used.
+**/
+DkBenchmarkResult segment(int idx, const QImage& img, const DkPolyRect& gt, const QString& method, const DkPageSegmentationConfig& config) {
+
+	DkBenchmarkResult r;
+	r.idx = idx;
+	QElapsedTimer dt;
+	dt.start();
+
+	DkPageSegmentation segM(img, method == "bhaskar", config);
+	segM.setGrayscaleSource(img.format() == QImage::Format_Grayscale8 || 
+		(img.format() == QImage::Format_Indexed8 && img.isGrayscale()));
+	segM.setEnsemble(method == "ensemble");
+	segM.compute();
+	segM.filterDuplicates();
+	if (config.refineCorners)
+		segM.refineCorners();
+	segM.computeConfidence();
+
+	r.time = dt.nsecsElapsed()/1e6;
+	r.iou = jaccardIndex(gt, segM.getMaxRect());
+	r.stats = segM.getStats();
+
+	return r;
+}
+
+QJsonObject evaluate(const std::vector<DkBenchmarkResult>& results, double wallTime, double megaPixels) {
+
+	std::vector<double> times, ious;
+	std::vector<double> stageTimes(DkSegmentationStats::stage_end, 0.0);
+	int numFailed = 0;
+
+	for (const DkBenchmarkResult& r : results) {
+
+		times.push_back(r.time);
+		ious.push_back(r.iou);
+
+		if (r.iou < 0.9)
+			numFailed++;
+
+		for (int sIdx = 0; sIdx < DkSegmentationStats::stage_end; sIdx++)
+			stageTimes[sIdx] += r.stats.time((DkSegmentationStats::Stage)sIdx);
+	}
+
+	std::sort(times.begin(), times.end());
+	std::sort(ious.begin(), ious.end());
+	double n = std::max((double)results.size(), 1.0);
+
+	QJsonObject latency;
+	latency["mean"] = std::accumulate(times.begin(), times.end(), 0.0)/n;
+	latency["p50"] = percentile(times, 0.5);
+	latency["p90"] = percentile(times, 0.9);
+	latency["p99"] = percentile(times, 0.99);
+	latency["max"] = times.empty() ? 0.0 : times.back();
+
+	QJsonObject stages;
+	for (int sIdx = 0; sIdx < DkSegmentationStats::stage_end; sIdx++) {
+		if (stageTimes[sIdx] > 0)
+			stages[DkSegmentationStats::stageName((DkSegmentationStats::Stage)sIdx)] = stageTimes[sIdx]/n;
+	}
+
+	QJsonObject o;
+	o["latencyMs"] = latency;
+	o["wallTimeS"] = wallTime;
+	o["imagesPerS"] = wallTime > 0 ? results.size()/wallTime : 0.0;
+	o["megaPixelsPerS"] = wallTime > 0 ? results.size()*megaPixels/wallTime : 0.0;
+	o["meanJaccard"] = std::accumulate(ious.begin(), ious.end(), 0.0)/n;
+	o["medianJaccard"] = percentile(ious, 0.5);
+	o["minJaccard"] = ious.empty() ? 0.0 : ious.front();
+	o["failures"] = numFailed;	// Jaccard < 0.9
+	o["meanStageTimeMs"] = stages;
+
+	return o;
+}
+
+};
+
+/**
+* Headless benchmark of the page segmentation.
+* Synthetic documents (see DkSyntheticPage) are segmented by every method 
+* at several thread counts - just like the plugin does in a nomacs batch.
+* Latency percentiles, throughput and the Jaccard index w.r.t. the ground 
+* truth are written as JSON.
+**/
+int main(int argc, char** argv) {
+
+	using namespace nmp;
+
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("pageSegmentationBenchmark");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Benchmarks the page segmentation on synthetic documents.");
+	parser.addHelpOption();
+
+	// the documents of a size are kept in memory (4 bytes per pixel) - e.g. 8 x 100 MP need 3.2 GB
+	QCommandLineOption sizesOpt("sizes", "Comma separated image sizes in megapixels.", "mp", "1,4,16");
+	QCommandLineOption imagesOpt("images", "Number of images per size.", "n", "8");
+	// the batch's threads and OpenCV's threads are swept separately - each image uses OpenCV's threads
+	QCommandLineOption threadsOpt("threads", "Comma separated numbers of images segmented concurrently (batch threads).", "t", 
+		QString("1,%1").arg(QThread::idealThreadCount()));
+	QCommandLineOption cvThreadsOpt("cv-threads", "Comma separated numbers of OpenCV threads (default: OpenCV's default).", "c", 
+		QString::number(cv::getNumThreads()));
+	QCommandLineOption methodsOpt("methods", "Comma separated methods (thresholds, bhaskar, ensemble).", "m", "thresholds,bhaskar");
+	QCommandLineOption presetOpt("preset", "Parameter preset (fast, balanced, accurate).", "preset", "balanced");
+	QCommandLineOption levelsOpt("levels", "Comma separated numbers of threshold levels (default: the preset's).", "n");
+	QCommandLineOption seedOpt("seed", "Seed of the synthetic documents.", "seed", "42");
+	QCommandLineOption outputOpt("output", "JSON file - the results are printed if omitted.", "file");
+
+	parser.addOption(sizesOpt);
+	parser.addOption(imagesOpt);
+	parser.addOption(threadsOpt);
+	parser.addOption(cvThreadsOpt);
+	parser.addOption(methodsOpt);
+	parser.addOption(presetOpt);
+	parser.addOption(levelsOpt);
+	parser.addOption(seedOpt);
+	parser.addOption(outputOpt);
+	parser.process(app);
+
+	DkPageSegmentationConfig config(DkPageSegmentationConfig::presetFromName(parser.value(presetOpt)));
+	QStringList methods = parser.value(methodsOpt).split(",", skipEmptyParts);
+	int numImages = std::max(parser.value(imagesOpt).toInt(), 1);
+
+	std::vector<int> threadCounts;
+	for (const QString& t : parser.value(threadsOpt).split(",", skipEmptyParts))
+		threadCounts.push_back(std::max(t.toInt(), 1));
+
+	std::vector<int> cvThreadCounts;
+	for (const QString& t : parser.value(cvThreadsOpt).split(",", skipEmptyParts))
+		cvThreadCounts.push_back(std::max(t.toInt(), 1));
+
+	// e.g. --levels 8,32,64 shows how the runtime grows with the threshold levels
+	std::vector<DkPageSegmentationConfig> configs;
+	QStringList levels = parser.value(levelsOpt).split(",", skipEmptyParts);
+
+	if (levels.empty())
+		levels << QString::number(config.numThresh);
+
+	for (const QString& l : levels) {
+		DkPageSegmentationConfig c = config;
+		c.numThresh = std::max(l.toInt(), 1);
+		configs.push_back(c);
+	}
+
+	DkSyntheticPage generator(parser.value(seedOpt).toUInt());
+	QJsonArray runs;
+
+	for (const QString& s : parser.value(sizesOpt).split(",", skipEmptyParts)) {
+
+		double megaPixels = s.toDouble();
+		if (megaPixels <= 0)
+			continue;
+
+		// render the documents of this size (they are released before the next size - 100 MP images are large)
+		qInfo().noquote() << "rendering" << numImages << "documents of" << s << "MP - about" 
+			<< qRound(numImages*megaPixels*4) << "MB";
+
+		QElapsedTimer rt;
+		rt.start();
+
+		std::vector<cv::Mat> imgs(numImages);
+		std::vector<QImage> qImgs(numImages);
+		std::vector<DkPolyRect> gts(numImages);
+		for (int idx = 0; idx < numImages; idx++) {
+			imgs[idx] = generator.render(megaPixels, gts[idx]);
+
+			// nomacs hands QImages to the plugin - BGRA is ARGB32's memory layout (wrapped, not copied)
+			qImgs[idx] = QImage(imgs[idx].data, imgs[idx].cols, imgs[idx].rows, (int)imgs[idx].step, QImage::Format_ARGB32);
+		}
+
+		qInfo().noquote() << numImages << "documents of" << s << "MP rendered in" << rt.elapsed() << "ms";
+
+		for (const QString& method : methods) {
+
+			for (const DkPageSegmentationConfig& cfg : configs) {
+
+				for (int numThreads : threadCounts) {
+
+					for (int cvThreads : cvThreadCounts) {
+
+						// numThreads images are segmented concurrently (nomacs batch) - each segmentation uses cvThreads OpenCV threads
+						cv::setNumThreads(cvThreads);
+						QThreadPool::globalInstance()->setMaxThreadCount(numThreads);
+
+						// warm-up: allocate the thread contexts
+						segment(0, qImgs[0], gts[0], method, cfg);
+
+						std::vector<DkBenchmarkResult> results(numImages);
+						for (int idx = 0; idx < numImages; idx++)
+							results[idx].idx = idx;
+
+						QElapsedTimer wt;
+						wt.start();
+
+						QtConcurrent::blockingMap(results, [&](DkBenchmarkResult& r) {
+							r = segment(r.idx, qImgs[r.idx], gts[r.idx], method, cfg);
+						});
+
+						double wallTime = wt.nsecsElapsed()/1e9;
+
+						QJsonObject run = evaluate(results, wallTime, megaPixels);
+						run["megaPixels"] = megaPixels;
+						run["width"] = imgs[0].cols;
+						run["height"] = imgs[0].rows;
+						run["method"] = method;
+						run["levels"] = cfg.numThresh;
+						run["threads"] = numThreads;
+						run["cvThreads"] = cvThreads;
+						run["images"] = numImages;
+						runs.append(run);
+
+						qInfo().noquote() << method << cfg.numThresh << "levels" 
+							<< s << "MP" << numThreads << "batch threads" << cvThreads << "OpenCV threads:" 
+							<< run["latencyMs"].toObject()["p50"].toDouble() << "ms (p50)," 
+							<< run["imagesPerS"].toDouble() << "images/s, Jaccard" << run["meanJaccard"].toDouble();
+					}
+				}
+			}
+		}
+	}
+
+	QJsonObject report;
+	report["preset"] = DkPageSegmentationConfig::presetName(config.preset);
+	report["seed"] = (int)parser.value(seedOpt).toUInt();
+	report["idealThreadCount"] = QThread::idealThreadCount();
+	report["runs"] = runs;
+
+	QByteArray json = QJsonDocument(report).toJson();
+
+	if (!parser.isSet(outputOpt)) {
+		fputs(json.constData(), stdout);
+		return 0;
+	}
+
+	QFile file(parser.value(outputOpt));
+	if (!file.open(QIODevice::WriteOnly)) {
+		qWarning() << "[DkPageBenchmark] could not write" << file.fileName();
+		return 1;
+	}
+
+	file.write(json);
+
+	return 0;
+}
@@ -0,0 +1,268 @@
+/*******************************************************************************************************
+ DkSyntheticPage.cpp
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2015 Markus Diem
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+
+#include "DkSyntheticPage.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include <algorithm>
+#include <cmath>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+// DkSyntheticPage --------------------------------------------------------------------
+DkSyntheticPage::DkSyntheticPage(unsigned int seed) : rng(seed) {
+}
+
+/**
+* Renders the next document.
+* @param megaPixels the image size - the aspect ratio is 4:3.
+* @param groundTruth the page's corners.
+* @return a BGRA image (the segmentation gets ARGB32 images from nomacs).
+**/
+cv::Mat DkSyntheticPage::render(double megaPixels, DkPolyRect& groundTruth) {
+
+	int width = cvRound(std::sqrt(megaPixels*1e6*4.0/3.0));
+	cv::Size size(width, cvRound(width*0.75));
+
+	// table, scanner lid or copy stand
+	double bgVal = rng.uniform(20.0, 140.0);
+	cv::Scalar bgCol(bgVal*rng.uniform(0.8, 1.2), bgVal*rng.uniform(0.8, 1.2), bgVal*rng.uniform(0.8, 1.2));
+	cv::Mat img = texture(size, bgCol, 25, 6);
+
+	cv::Size pageSize;
+	std::vector<cv::Point2f> quad = pageQuad(size, pageSize);
+	shade(img, quad);
+
+	double paper = rng.uniform(200.0, 250.0);
+	cv::Scalar paperCol(paper*rng.uniform(0.9, 1.0), paper*rng.uniform(0.95, 1.0), paper);
+	cv::Mat page = texture(pageSize, paperCol, 8, 3);
+	drawText(page);
+
+	// warp the page - only its bounding box is written
+	cv::Rect box = cv::boundingRect(quad) & cv::Rect(cv::Point(), size);
+
+	std::vector<cv::Point2f> src;
+	src.push_back(cv::Point2f(0, 0));
+	src.push_back(cv::Point2f((float)pageSize.width, 0));
+	src.push_back(cv::Point2f((float)pageSize.width, (float)pageSize.height));
+	src.push_back(cv::Point2f(0, (float)pageSize.height));
+
+	std::vector<cv::Point2f> dst;
+	for (const cv::Point2f& p : quad)
+		dst.push_back(p - cv::Point2f((float)box.x, (float)box.y));
+
+	cv::Mat roi = img(box);
+	cv::warpPerspective(page, roi, cv::getPerspectiveTransform(src, dst), box.size(), cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+
+	light(img);
+	addNoise(img, rng.uniform(2.0, 8.0));
+
+	std::vector<nmc::DkVector> pts;
+	for (const cv::Point2f& p : quad)
+		pts.push_back(nmc::DkVector(p.x, p.y));
+	groundTruth = DkPolyRect(pts);
+
+	cv::cvtColor(img, img, CV_BGR2BGRA);
+
+	return img;
+}
+
+/**
+* Returns a random perspective quad (clockwise) that lies within the image.
+* @param pageSize the size of the unwarped page.
+**/
+std::vector<cv::Point2f> DkSyntheticPage::pageQuad(const cv::Size& size, cv::Size& pageSize) {
+
+	const double pageRatio = std::sqrt(2.0);	// A4
+	float margin = 0.02f*std::min(size.width, size.height);
+	bool landscape = rng.uniform(0, 4) == 0;
+
+	for (int idx = 0; idx < 100; idx++) {
+
+		double area = rng.uniform(0.2, 0.55)*size.area();
+		double pw = std::sqrt(area/pageRatio);
+		double ph = pw*pageRatio;
+
+		if (landscape)
+			std::swap(pw, ph);
+
+		double angle = rng.uniform(-12.0, 12.0)*CV_PI/180.0;
+		double ca = std::cos(angle), sa = std::sin(angle);
+		double jitter = 0.04*std::min(pw, ph);
+		cv::Point2f c((float)(size.width*rng.uniform(0.4, 0.6)), (float)(size.height*rng.uniform(0.4, 0.6)));
+
+		const double xs[] = {-0.5, 0.5, 0.5, -0.5};
+		const double ys[] = {-0.5, -0.5, 0.5, 0.5};
+
+		std::vector<cv::Point2f> quad;
+		bool inside = true;
+
+		for (int cIdx = 0; cIdx < 4; cIdx++) {
+
+			double x = xs[cIdx]*pw + rng.uniform(-jitter, jitter);
+			double y = ys[cIdx]*ph + rng.uniform(-jitter, jitter);
+			cv::Point2f p((float)(c.x + ca*x - sa*y), (float)(c.y + sa*x + ca*y));
+
+			inside &= p.x >= margin && p.y >= margin && p.x < size.width-margin && p.y < size.height-margin;
+			quad.push_back(p);
+		}
+
+		if (inside) {
+			pageSize = cv::Size(cvRound(pw), cvRound(ph));
+			return quad;
+		}
+	}
+
+	// fallback: an upright page
+	pageSize = cv::Size(size.width/3, size.height/2);
+
+	std::vector<cv::Point2f> quad;
+	quad.push_back(cv::Point2f(size.width/3.0f, size.height/4.0f));
+	quad.push_back(cv::Point2f(size.width*2/3.0f, size.height/4.0f));
+	quad.push_back(cv::Point2f(size.width*2/3.0f, size.height*3/4.0f));
+	quad.push_back(cv::Point2f(size.width/3.0f, size.height*3/4.0f));
+
+	return quad;
+}
+
+/**
+* Returns a texture with low frequency variations (stains, uneven material) and grain.
+**/
+cv::Mat DkSyntheticPage::texture(const cv::Size& size, const cv::Scalar& color, double variation, double grain) {
+
+	cv::Mat low(rng.uniform(4, 12), rng.uniform(4, 12), CV_8UC3);
+	rng.fill(low, cv::RNG::NORMAL, color, cv::Scalar::all(variation));
+
+	cv::Mat tex;
+	cv::resize(low, tex, size, 0, 0, CV_INTER_CUBIC);
+	addNoise(tex, grain);
+
+	return tex;
+}
+
+/**
+* Draws paragraphs of words (filled boxes) in one or two columns and some figures.
+**/
+void DkSyntheticPage::drawText(cv::Mat& page) {
+
+	int lineHeight = std::max(3, cvRound(page.rows*rng.uniform(0.008, 0.014)));
+	int margin = cvRound(page.cols*rng.uniform(0.06, 0.12));
+	int numColumns = rng.uniform(1, 3);
+	int gap = margin/2;
+	int colWidth = (page.cols - 2*margin - (numColumns-1)*gap)/numColumns;
+	int bottom = page.rows - margin;
+	cv::Scalar ink = cv::Scalar::all(rng.uniform(10, 70));
+
+	for (int cIdx = 0; cIdx < numColumns; cIdx++) {
+
+		int x0 = margin + cIdx*(colWidth + gap);
+		int y = margin;
+
+		while (y + lineHeight < bottom) {
+
+			// figure
+			if (rng.uniform(0, 6) == 0) {
+
+				int figHeight = std::min(cvRound(colWidth*rng.uniform(0.3, 0.7)), bottom - y);
+				cv::Rect fig(x0, y, colWidth, figHeight);
+				cv::rectangle(page, fig, cv::Scalar::all(rng.uniform(60, 200)), CV_FILLED);
+				cv::rectangle(page, fig, ink, std::max(1, lineHeight/8));
+				y += figHeight + 2*lineHeight;
+				continue;
+			}
+
+			int numLines = rng.uniform(3, 15);
+
+			for (int lIdx = 0; lIdx < numLines && y + lineHeight < bottom; lIdx++) {
+
+				int lineEnd = lIdx == numLines-1 ? x0 + cvRound(colWidth*rng.uniform(0.2, 0.9)) : x0 + colWidth;
+
+				for (int x = x0; x < lineEnd;) {
+
+					int wordWidth = std::min(cvRound(lineHeight*rng.uniform(1.0, 5.0)), lineEnd - x);
+					cv::rectangle(page, cv::Rect(x, y, wordWidth, lineHeight*7/10), ink, CV_FILLED);
+					x += wordWidth + lineHeight/2;
+				}
+
+				y += lineHeight*8/5;
+			}
+
+			y += lineHeight;	// paragraph
+		}
+	}
+}
+
+/**
+* Darkens the background by the page's (blurred) drop shadow.
+**/
+void DkSyntheticPage::shade(cv::Mat& img, const std::vector<cv::Point2f>& quad) {
+
+	// it is blurred anyway - so we render it at a low resolution
+	const int ds = 8;
+	cv::Size sSize(img.cols/ds + 1, img.rows/ds + 1);
+	float shift = 0.01f*std::max(sSize.width, sSize.height);
+	cv::Point2f offset(rng.uniform(-shift, shift), rng.uniform(-shift, shift));
+
+	std::vector<cv::Point> pts;
+	for (const cv::Point2f& p : quad)
+		pts.push_back(p*(1.0f/ds) + offset);
+
+	cv::Mat mask(sSize, CV_8UC1, cv::Scalar(0));
+	cv::fillConvexPoly(mask, pts, cv::Scalar(255*rng.uniform(0.3, 0.7)));
+	cv::GaussianBlur(mask, mask, cv::Size(), 0.01*std::max(sSize.width, sSize.height) + 1);
+
+	cv::Mat shadow;
+	cv::resize(255 - mask, shadow, img.size(), 0, 0, CV_INTER_LINEAR);
+	cv::cvtColor(shadow, shadow, CV_GRAY2BGR);
+	cv::multiply(img, shadow, img, 1.0/255);
+}
+
+/**
+* Uneven lighting - a bilinear gradient between the image corners.
+**/
+void DkSyntheticPage::light(cv::Mat& img) {
+
+	cv::Mat corners(2, 2, CV_8UC1);
+	for (int idx = 0; idx < 4; idx++)
+		corners.at<uchar>(idx/2, idx%2) = cv::saturate_cast<uchar>(255*rng.uniform(0.7, 1.0));
+
+	cv::Mat gradient;
+	cv::resize(corners, gradient, img.size(), 0, 0, CV_INTER_LINEAR);
+	cv::cvtColor(gradient, gradient, CV_GRAY2BGR);
+	cv::multiply(img, gradient, img, 1.0/255);
+}
+
+void DkSyntheticPage::addNoise(cv::Mat& img, double sigma) {
+
+	cv::Mat noise(img.size(), img.type());
+	rng.fill(noise, cv::RNG::NORMAL, cv::Scalar::all(128), cv::Scalar::all(sigma));
+	cv::addWeighted(img, 1.0, noise, 1.0, -128.0, img);
+}
+
+};
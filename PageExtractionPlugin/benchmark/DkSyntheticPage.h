@@ -0,0 +1,60 @@
+/*******************************************************************************************************
+ DkSyntheticPage.h
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2011-2015 Markus Diem <markus@nomacs.org>
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+
+#pragma once
+
+#include "DkPageSegmentationUtils.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <opencv2/core/core.hpp>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+/**
+* Renders synthetic document photographs with known ground truth.
+* A page (paper texture, text blocks) is warped by a random perspective 
+* quad onto a textured background. A drop shadow, uneven lighting and 
+* sensor noise are added. The same seed renders the same documents.
+**/
+class DkSyntheticPage {
+
+public:
+	DkSyntheticPage(unsigned int seed = 42);
+
+	cv::Mat render(double megaPixels, DkPolyRect& groundTruth);
+
+protected:
+	cv::RNG rng;
+
+	std::vector<cv::Point2f> pageQuad(const cv::Size& size, cv::Size& pageSize);
+	cv::Mat texture(const cv::Size& size, const cv::Scalar& color, double variation, double grain);
+	void drawText(cv::Mat& page);
+	void shade(cv::Mat& img, const std::vector<cv::Point2f>& quad);
+	void light(cv::Mat& img);
+	void addNoise(cv::Mat& img, double sigma);
+};
+
+};
@@ -0,0 +1,373 @@
+/*******************************************************************************************************
+ DkBackgroundModel.cpp
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2015 Markus Diem
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+#include "DkBackgroundModel.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <QDebug>
+
+#include <algorithm>
+#include <functional>
+
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+// DkBackgroundModel --------------------------------------------------------------------
+/**
+* Creates an empty background model.
+* @param numSamples number of images needed to learn the background.
+* @param workingWidth width of the working image [px].
+**/
+DkBackgroundModel::DkBackgroundModel(int numSamples, int workingWidth) 
+	: numSamples(std::max(numSamples, 1)), workingWidth(std::max(workingWidth, 16)) {
+}
+
+/**
+* Adds an image of the setup.
+* The background is learned as soon as enough samples were added.
+* @param img the full resolution image - all samples need to have the same size.
+* @param page the page found in img (full resolution coordinates) - it is not part of the background.
+**/
+void DkBackgroundModel::addSample(const cv::Mat& img, const DkPolyRect& page) {
+
+	if (isTrained() || img.empty())
+		return;
+
+	if (samples.empty()) {
+		imgSize = img.size();
+		scale = std::min((float)workingWidth/img.cols, 1.0f);
+	}
+	else if (!isCompatible(img.size())) {
+		qDebug() << "[DkBackgroundModel] ignoring sample of different size";
+		return;
+	}
+
+	cv::Mat sImg = downscale(img);
+	cv::Mat mask(sImg.size(), CV_8UC1, cv::Scalar(0));
+
+	if (!page.empty()) {
+
+		DkPolyRect sPage = page;
+		sPage.scale(scale);
+
+		std::vector<cv::Point> pts = sPage.toCvPoints();
+		cv::fillConvexPoly(mask, pts, cv::Scalar(255));
+
+		// shadows & blur at the page's border are not part of the background either
+		cv::dilate(mask, mask, cv::getStructuringElement(cv::MORPH_RECT, cv::Size(7, 7)));
+	}
+
+	samples.push_back(sImg);
+	masks.push_back(mask);
+
+	if ((int)samples.size() >= numSamples)
+		train();
+}
+
+/**
+* Learns the background from a single calibration image (i.e. the empty setup).
+* The noise of the setup cannot be estimated from one image - a minimal deviation is assumed.
+**/
+void DkBackgroundModel::setImage(const cv::Mat& img) {
+
+	clear();
+
+	if (img.empty())
+		return;
+
+	int n = numSamples;
+	numSamples = 1;
+	addSample(img);
+	numSamples = n;
+}
+
+void DkBackgroundModel::clear() {
+
+	samples.clear();
+	masks.clear();
+	median.release();
+	sigma.release();
+	unknown.release();
+	imgSize = cv::Size();
+	scale = 1.0f;
+}
+
+bool DkBackgroundModel::isTrained() const {
+
+	return !median.empty();
+}
+
+bool DkBackgroundModel::isCompatible(const cv::Size& size) const {
+
+	return size == imgSize;
+}
+
+/**
+* Returns the number of samples that are still needed to learn the background.
+**/
+int DkBackgroundModel::numSamplesNeeded() const {
+
+	return isTrained() ? 0 : numSamples - (int)samples.size();
+}
+
+float DkBackgroundModel::getScale() const {
+
+	return scale;
+}
+
+/**
+* Finds the page as the largest foreground region.
+* Pixels that differ significantly from the background (or that were never observed) are foreground.
+* Pixels covered by a page in every sample are unknown - e.g. on copy stands, where the pages of all
+* samples are at the same location. A region that contains unknown pixels is only accepted if its 
+* outline lies on known pixels that differ from the background (e.g. a page that is larger than 
+* the unknown region). Otherwise, the next smaller region is tested.
+* @param img the full resolution image.
+* @param minArea the minimal area of the page [px] w.r.t. the full resolution image.
+* @return the page - empty if there is none.
+**/
+DkPolyRect DkBackgroundModel::segment(const cv::Mat& img, double minArea) const {
+
+	const float k = 3.0f;			// deviations
+	const float minSigma = 4.0f;	// gray values - compression & sensor noise
+	const double minSupport = 0.8;	// fraction of the outline that lies on known foreground
+
+	if (!isTrained() || !isCompatible(img.size()))
+		return DkPolyRect();
+
+	cv::Mat sImg = downscale(img);
+	cv::Mat fg(sImg.size(), CV_8UC1);
+
+	cv::parallel_for_(cv::Range(0, sImg.rows), [&](const cv::Range& r) {
+
+		for (int y = r.start; y < r.end; y++) {
+
+			const unsigned char* sp = sImg.ptr<unsigned char>(y);
+			const unsigned char* mp = median.ptr<unsigned char>(y);
+			const float* sigp = sigma.ptr<float>(y);
+			unsigned char* fp = fg.ptr<unsigned char>(y);
+
+			for (int x = 0; x < sImg.cols; x++, sp += 3, mp += 3) {
+
+				int d = std::max(std::max(abs(sp[0]-mp[0]), abs(sp[1]-mp[1])), abs(sp[2]-mp[2]));
+				fp[x] = (sigp[x] < 0 || d > k*std::max(sigp[x], minSigma)) ? 255 : 0;
+			}
+		}
+	});
+
+	cv::morphologyEx(fg, fg, cv::MORPH_OPEN, cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3)));
+	cv::morphologyEx(fg, fg, cv::MORPH_CLOSE, cv::getStructuringElement(cv::MORPH_RECT, cv::Size(7, 7)));
+
+	// known foreground - the outline of a page needs to be found there (+/- 1 px)
+	cv::Mat support;
+	if (!unknown.empty()) {
+		support = fg.clone();
+		support.setTo(0, unknown);
+		cv::dilate(support, support, cv::Mat());
+	}
+
+	std::vector<std::vector<cv::Point> > contours;
+	cv::findContours(fg, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+
+	std::vector<std::pair<double, int> > areas;
+	for (int idx = 0; idx < (int)contours.size(); idx++)
+		areas.push_back(std::make_pair(cv::contourArea(contours[idx]), idx));
+
+	std::sort(areas.begin(), areas.end(), std::greater<std::pair<double, int> >());
+
+	for (const std::pair<double, int>& a : areas) {
+
+		if (a.first <= 0 || a.first < minArea*scale*scale)
+			break;
+
+		DkPolyRect page = toPage(contours[a.second]);
+
+		if (!support.empty() && outlineSupport(page, support) < minSupport) {
+			qDebug() << "[DkBackgroundModel] the outline of a region lies on background that was never observed - rejected";
+			continue;
+		}
+
+		page.scale(1.0f/scale);
+		return page;
+	}
+
+	return DkPolyRect();
+}
+
+/**
+* Returns the quadrilateral of a foreground region (working resolution).
+**/
+DkPolyRect DkBackgroundModel::toPage(const std::vector<cv::Point>& contour) const {
+
+	std::vector<cv::Point> hull, approx;
+	cv::convexHull(contour, hull);
+	cv::approxPolyDP(hull, approx, cv::arcLength(hull, true)*0.02, true);
+
+	if (approx.size() == 4)
+		return DkPolyRect(approx);
+
+	// e.g. rounded corners or a shadow - fall back to the minimal bounding box
+	cv::Point2f pts[4];
+	cv::minAreaRect(hull).points(pts);
+
+	std::vector<nmc::DkVector> corners;
+	for (const cv::Point2f& p : pts)
+		corners.push_back(nmc::DkVector(p.x, p.y));
+
+	return DkPolyRect(corners);
+}
+
+/**
+* Returns the fraction of the page's outline that lies on the support mask.
+* @param page the page (working resolution).
+* @param support CV_8UC1 mask - non-zero pixels support the outline.
+**/
+double DkBackgroundModel::outlineSupport(const DkPolyRect& page, const cv::Mat& support) const {
+
+	int numSamples = 0;
+	int numSupported = 0;
+
+	for (int idx = 0; idx < page.size(); idx++) {
+
+		nmc::DkVector a = page.corner(idx);
+		nmc::DkVector b = page.corner((idx+1) % page.size());
+		nmc::DkVector dir = b-a;
+		int n = std::max(qRound(dir.norm()), 1);
+
+		for (int sIdx = 0; sIdx < n; sIdx++) {
+
+			nmc::DkVector p = a + dir*((float)sIdx/n);
+			int x = qRound(p.x);
+			int y = qRound(p.y);
+
+			numSamples++;
+
+			if (x >= 0 && y >= 0 && x < support.cols && y < support.rows && support.at<unsigned char>(y, x))
+				numSupported++;
+		}
+	}
+
+	return numSamples > 0 ? (double)numSupported/numSamples : 0.0;
+}
+
+/**
+* Converts img to 3 channels at the working resolution.
+* img is downscaled first, so the full resolution image is read once and never copied.
+**/
+cv::Mat DkBackgroundModel::downscale(const cv::Mat& img) const {
+
+	cv::Mat sImg = img;
+
+	if (scale != 1.0f)
+		cv::resize(img, sImg, cv::Size(), scale, scale, CV_INTER_AREA);
+
+	cv::Mat cImg;
+
+	if (sImg.channels() == 4)
+		cv::cvtColor(sImg, cImg, CV_BGRA2BGR);
+	else if (sImg.channels() == 1)
+		cv::cvtColor(sImg, cImg, CV_GRAY2BGR);
+	else
+		cImg = scale != 1.0f ? sImg : img.clone();	// never share img's buffer
+
+	return cImg;
+}
+
+/**
+* Computes the per-pixel median and the median absolute deviation (MAD) of the samples.
+* Only samples that do not cover the pixel with a page are considered.
+**/
+void DkBackgroundModel::train() {
+
+	if (samples.empty())
+		return;
+
+	const cv::Size size = samples[0].size();
+	const int n = (int)samples.size();
+
+	median.create(size, CV_8UC3);
+	sigma.create(size, CV_32FC1);
+
+	cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range& r) {
+
+		std::vector<unsigned char> vals(n);
+		std::vector<int> devs(n);
+
+		for (int y = r.start; y < r.end; y++) {
+
+			unsigned char* mp = median.ptr<unsigned char>(y);
+			float* sp = sigma.ptr<float>(y);
+
+			for (int x = 0; x < size.width; x++) {
+
+				float maxSigma = 0;
+				int nv = 0;
+
+				for (int c = 0; c < 3; c++) {
+
+					nv = 0;
+					for (int sIdx = 0; sIdx < n; sIdx++) {
+						if (!masks[sIdx].ptr<unsigned char>(y)[x])
+							vals[nv++] = samples[sIdx].ptr<unsigned char>(y)[x*3+c];
+					}
+
+					if (nv == 0)
+						break;
+
+					std::nth_element(vals.begin(), vals.begin() + nv/2, vals.begin() + nv);
+					int med = vals[nv/2];
+
+					for (int vIdx = 0; vIdx < nv; vIdx++)
+						devs[vIdx] = abs(vals[vIdx]-med);
+
+					std::nth_element(devs.begin(), devs.begin() + nv/2, devs.begin() + nv);
+
+					mp[x*3+c] = (unsigned char)med;
+					maxSigma = std::max(maxSigma, 1.4826f*devs[nv/2]);	// MAD -> standard deviation
+				}
+
+				if (nv == 0) {
+					mp[x*3] = mp[x*3+1] = mp[x*3+2] = 0;
+					sp[x] = -1.0f;	// always covered by a page
+				}
+				else
+					sp[x] = maxSigma;
+			}
+		}
+	});
+
+	samples.clear();
+	masks.clear();
+
+	int numUnknown = cv::countNonZero(sigma < 0);
+	if (numUnknown > 0)
+		unknown = sigma < 0;
+
+	qDebug() << "[DkBackgroundModel] background learned from" << n << "images," << numUnknown << "pixels never observed";
+}
+
+};
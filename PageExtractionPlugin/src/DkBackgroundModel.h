@@ -0,0 +1,77 @@
+/*******************************************************************************************************
+ DkBackgroundModel.h
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2011-2015 Markus Diem <markus@nomacs.org>
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+#pragma once
+
+#include "DkPageSegmentationUtils.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <opencv2/core/core.hpp>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+/**
+* Static background of fixed scanner or copy stand setups.
+* The per-pixel median and its deviation (MAD) are learned at a low working resolution
+* from images of the setup - pixels covered by their pages are ignored. Later images are
+* segmented by thresholding their difference to the background.
+**/
+class DkBackgroundModel {
+
+public:
+	DkBackgroundModel(int numSamples = 5, int workingWidth = 480);
+
+	void addSample(const cv::Mat& img, const DkPolyRect& page = DkPolyRect());
+	void setImage(const cv::Mat& img);
+	void clear();
+
+	bool isTrained() const;
+	bool isCompatible(const cv::Size& size) const;
+	int numSamplesNeeded() const;
+	float getScale() const;
+
+	DkPolyRect segment(const cv::Mat& img, double minArea = 0) const;
+
+protected:
+	int numSamples;
+	int workingWidth;
+
+	cv::Size imgSize;		// size of the full resolution images
+	float scale = 1.0f;		// working resolution / full resolution
+
+	std::vector<cv::Mat> samples;
+	std::vector<cv::Mat> masks;	// 255 where a page covered the sample
+
+	cv::Mat median;			// CV_8UC3
+	cv::Mat sigma;			// CV_32FC1 - negative where the background was never observed
+	cv::Mat unknown;		// CV_8UC1 - 255 where the background was never observed
+
+	cv::Mat downscale(const cv::Mat& img) const;
+	DkPolyRect toPage(const std::vector<cv::Point>& contour) const;
+	double outlineSupport(const DkPolyRect& page, const cv::Mat& support) const;
+	void train();
+};
+
+};
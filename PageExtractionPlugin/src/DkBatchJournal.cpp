@@ -0,0 +1,247 @@
+/*******************************************************************************************************
+ DkBatchJournal.cpp
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2015 Markus Diem
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+#include "DkBatchJournal.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QStringList>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+// QString::SkipEmptyParts is deprecated since Qt 5.14
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+static const Qt::SplitBehavior skipEmptyParts = Qt::SkipEmptyParts;
+#else
+static const QString::SplitBehavior skipEmptyParts = QString::SkipEmptyParts;
+#endif
+
+// DkBatchJournal --------------------------------------------------------------------
+// a line: params \t file path \t size \t modified \t time [ms] \t pages
+// pages are separated by ';' - a page: score:x0,y0,x1,y1,x2,y2,x3,y3
+// size and modified are those of the input file when it was journaled
+DkBatchJournal::DkBatchJournal() {
+}
+
+DkBatchJournal::~DkBatchJournal() {
+	close();
+}
+
+/**
+* Opens the journal.
+* Entries of previous runs are loaded and new entries are appended.
+* @param filePath the journal's file path.
+* @param params a fingerprint of the detection parameters - entries of other parameters are ignored.
+* @return false if the journal cannot be written.
+**/
+bool DkBatchJournal::open(const QString& filePath, const QByteArray& params) {
+
+	close();
+
+	QMutexLocker locker(&mutex);
+
+	paramsHash = QString::fromLatin1(QCryptographicHash::hash(params, QCryptographicHash::Md5).toHex().left(16));
+	file.setFileName(filePath);
+
+	if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+
+		// an interrupted run might have left an incomplete last line - only newline-terminated lines are read
+		QStringList lines = QString::fromUtf8(file.readAll()).split('\n');
+		lines.removeLast();
+
+		std::vector<DkPolyRect> rects;
+		for (const QString& line : lines) {
+
+			if (parse(line, rects))
+				entries.insert(QStringList(line.split('\t').mid(0, 2)).join('\t'), line);
+		}
+
+		file.close();
+		qDebug() << "[DkBatchJournal]" << entries.size() << "images journaled in" << filePath;
+	}
+
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text)) {
+		qWarning() << "[DkBatchJournal] could not open" << filePath << file.errorString();
+		entries.clear();
+		return false;
+	}
+
+	return true;
+}
+
+/**
+* Closes the journal.
+* Entries that were journaled several times (e.g. if the parameters changed) are compacted.
+**/
+void DkBatchJournal::close() {
+
+	QMutexLocker locker(&mutex);
+
+	if (!file.isOpen())
+		return;
+
+	file.close();
+	compact();
+	entries.clear();
+}
+
+bool DkBatchJournal::isOpen() const {
+
+	QMutexLocker locker(&mutex);
+	return file.isOpen();
+}
+
+/**
+* Returns the journaled pages of a file.
+* A file that changed since it was journaled is detected again. If the batch writes the file 
+* in place, the change is the batch's output - written is set and the pages are returned.
+* @param inPlace true if the batch writes the file itself.
+* @param written set to true if the file was written since it was journaled (in place only).
+* @return false if the file was not journaled (with the current parameters).
+**/
+bool DkBatchJournal::find(const QFileInfo& fileInfo, std::vector<DkPolyRect>& rects, bool inPlace, bool* written) const {
+
+	QString line;
+	{
+		QMutexLocker locker(&mutex);
+		line = entries.value(key(fileInfo));
+	}
+
+	if (line.isEmpty() || !parse(line, rects))
+		return false;
+
+	bool changed = QStringList(line.split('\t').mid(2, 2)).join('\t') != fileStamp(fileInfo);
+
+	if (written)
+		*written = inPlace && changed;
+
+	return inPlace || !changed;
+}
+
+/**
+* Appends a file to the journal.
+* The line is flushed immediately, so it survives if the batch is killed.
+**/
+void DkBatchJournal::append(const QFileInfo& fileInfo, const std::vector<DkPolyRect>& rects, int time) {
+
+	QStringList pages;
+
+	for (const DkPolyRect& r : rects) {
+
+		QStringList coords;
+		for (int idx = 0; idx < r.size(); idx++)
+			coords << QString::number(r.corner(idx).x, 'f', 1) << QString::number(r.corner(idx).y, 'f', 1);
+
+		pages << QString::number(r.getConfidence().score, 'f', 3) + ":" + coords.join(',');
+	}
+
+	QMutexLocker locker(&mutex);
+
+	if (!file.isOpen())
+		return;
+
+	QString k = key(fileInfo);
+	QString line = k + "\t" + fileStamp(fileInfo) + "\t" + QString::number(time) + "\t" + pages.join(';');
+	entries.insert(k, line);
+
+	file.write((line + "\n").toUtf8());
+	file.flush();
+}
+
+QString DkBatchJournal::key(const QFileInfo& fileInfo) const {
+
+	return paramsHash + "\t" + fileInfo.absoluteFilePath();
+}
+
+/**
+* Returns the file's size and modification time - they change if the file is written.
+**/
+QString DkBatchJournal::fileStamp(const QFileInfo& fileInfo) const {
+
+	return QString::number(fileInfo.size()) + "\t" + QString::number(fileInfo.lastModified().toMSecsSinceEpoch());
+}
+
+bool DkBatchJournal::parse(const QString& line, std::vector<DkPolyRect>& rects) const {
+
+	QStringList fields = line.split('\t');
+
+	if (fields.size() != 6)
+		return false;
+
+	std::vector<DkPolyRect> jRects;
+
+	for (const QString& page : fields[5].split(';', skipEmptyParts)) {
+
+		QStringList sc = page.split(':');
+		QStringList coords = sc.value(1).split(',', skipEmptyParts);
+
+		if (sc.size() != 2 || coords.size() != 2*DkPolyRect::max_corners)
+			return false;
+
+		std::vector<nmc::DkVector> pts;
+		for (int idx = 0; idx+1 < coords.size(); idx += 2)
+			pts.push_back(nmc::DkVector(coords[idx].toFloat(), coords[idx+1].toFloat()));
+
+		DkPageConfidence c;
+		c.score = sc[0].toDouble();
+
+		DkPolyRect r(pts);
+		r.setConfidence(c);
+		jRects.push_back(r);
+	}
+
+	rects = jRects;
+
+	return true;
+}
+
+/**
+* Rewrites the journal with the latest entry of every file.
+* The file is replaced atomically - the caller needs to lock the mutex.
+**/
+void DkBatchJournal::compact() {
+
+	QSaveFile sf(file.fileName());
+
+	if (!sf.open(QIODevice::WriteOnly | QIODevice::Text)) {
+		qWarning() << "[DkBatchJournal] could not compact" << file.fileName() << sf.errorString();
+		return;
+	}
+
+	QStringList keys = entries.keys();
+	keys.sort();
+
+	for (const QString& k : keys)
+		sf.write((entries.value(k) + "\n").toUtf8());
+
+	if (sf.commit())
+		qDebug() << "[DkBatchJournal]" << keys.size() << "images written to" << file.fileName();
+}
+
+};
@@ -0,0 +1,73 @@
+/*******************************************************************************************************
+ DkBatchJournal.h
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2011-2015 Markus Diem <markus@nomacs.org>
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+#pragma once
+
+#include "DkPageSegmentationUtils.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <QByteArray>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+/**
+* Append-only journal of processed images.
+* Every image processed is appended (one line) with its pages and the detection time.
+* If a batch is interrupted, the images journaled are not detected again when it is restarted.
+* Entries are keyed by the file's path and the detection parameters. A file is only journaled
+* if its size and modification time did not change - unless the batch writes it in place.
+* All functions are thread-safe.
+**/
+class DkBatchJournal {
+
+public:
+	DkBatchJournal();
+	~DkBatchJournal();
+
+	bool open(const QString& filePath, const QByteArray& params);
+	void close();
+	bool isOpen() const;
+
+	bool find(const QFileInfo& fileInfo, std::vector<DkPolyRect>& rects, bool inPlace = false, bool* written = 0) const;
+	void append(const QFileInfo& fileInfo, const std::vector<DkPolyRect>& rects, int time);
+
+protected:
+	mutable QMutex mutex;
+	QFile file;
+	QString paramsHash;
+	QHash<QString, QString> entries;	// key (params & path) -> journal line
+
+	QString key(const QFileInfo& fileInfo) const;
+	QString fileStamp(const QFileInfo& fileInfo) const;
+	bool parse(const QString& line, std::vector<DkPolyRect>& rects) const;
+	void compact();
+};
+
+};
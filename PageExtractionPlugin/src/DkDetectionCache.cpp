@@ -0,0 +1,186 @@
+/*******************************************************************************************************
+ DkDetectionCache.cpp
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2015 Markus Diem
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+#include "DkDetectionCache.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+// the file format - increase the version if the format or the detection's results change
+static const quint32 cacheMagic = 0x444b5043;	// DKPC
+static const quint32 cacheVersion = 1;
+
+// DkDetectionCache --------------------------------------------------------------------
+/**
+* Creates a cache.
+* @param dirPath the cache's directory - the cache is disabled if it is empty.
+**/
+DkDetectionCache::DkDetectionCache(const QString& dirPath) : dirPath(dirPath) {
+}
+
+bool DkDetectionCache::isEnabled() const {
+
+	return !dirPath.isEmpty();
+}
+
+/**
+* Computes the key of an image.
+* Only the visible pixels are hashed (not the padding of the scan lines).
+* @param img the decoded image.
+* @param params a fingerprint of the detection parameters.
+**/
+QByteArray DkDetectionCache::key(const QImage& img, const QByteArray& params) {
+
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+
+	QByteArray header;
+	QDataStream ds(&header, QIODevice::WriteOnly);
+	ds << cacheVersion << img.width() << img.height() << (qint32)img.format();
+
+	hash.addData(header);
+	hash.addData(params);
+
+	const int lineBytes = (img.width()*img.depth()+7)/8;
+
+	for (int y = 0; y < img.height(); y++)
+		hash.addData((const char*)img.constScanLine(y), lineBytes);
+
+	return hash.result().toHex();
+}
+
+/**
+* Loads the pages of an image.
+* @return false if the image is not cached.
+**/
+bool DkDetectionCache::load(const QByteArray& key, std::vector<DkPolyRect>& rects) const {
+
+	if (!isEnabled())
+		return false;
+
+	QFile file(filePath(key));
+
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+
+	QDataStream ds(&file);
+	quint32 magic = 0, version = 0, numRects = 0;
+	ds >> magic >> version >> numRects;
+
+	if (magic != cacheMagic || version != cacheVersion)
+		return false;
+
+	std::vector<DkPolyRect> cRects;
+
+	for (quint32 idx = 0; idx < numRects && ds.status() == QDataStream::Ok; idx++) {
+
+		qint32 numPts = 0, channel = -1, level = -1;
+		ds >> numPts >> channel >> level;
+
+		std::vector<nmc::DkVector> pts;
+		for (int pIdx = 0; pIdx < numPts && pIdx < DkPolyRect::max_corners; pIdx++) {
+			float x = 0, y = 0;
+			ds >> x >> y;
+			pts.push_back(nmc::DkVector(x, y));
+		}
+
+		DkPageConfidence c;
+		qint32 numLevels = 0, numChannels = 0;
+		ds >> c.edgeSupport >> c.maxCosine >> numLevels >> numChannels >> c.areaRatio >> c.score;
+		c.numLevels = numLevels;
+		c.numChannels = numChannels;
+
+		DkPolyRect r(pts);
+		r.setOrigin(channel, level);
+		r.setConfidence(c);
+		cRects.push_back(r);
+	}
+
+	// truncated or corrupt entry
+	if (ds.status() != QDataStream::Ok) {
+		qWarning() << "[DkDetectionCache] corrupt cache entry" << file.fileName();
+		return false;
+	}
+
+	rects = cRects;
+
+	return true;
+}
+
+/**
+* Saves the pages of an image.
+* The entry is written to a temporary file that replaces the entry when it is complete.
+**/
+bool DkDetectionCache::save(const QByteArray& key, const std::vector<DkPolyRect>& rects) const {
+
+	if (!isEnabled())
+		return false;
+
+	QString fp = filePath(key);
+	QDir().mkpath(QFileInfo(fp).absolutePath());
+
+	QSaveFile file(fp);
+
+	if (!file.open(QIODevice::WriteOnly)) {
+		qWarning() << "[DkDetectionCache] could not write" << fp << file.errorString();
+		return false;
+	}
+
+	QDataStream ds(&file);
+	ds << cacheMagic << cacheVersion << (quint32)rects.size();
+
+	for (const DkPolyRect& r : rects) {
+
+		ds << (qint32)r.size() << (qint32)r.getChannel() << (qint32)r.getLevel();
+
+		for (int idx = 0; idx < r.size(); idx++)
+			ds << r.corner(idx).x << r.corner(idx).y;
+
+		const DkPageConfidence& c = r.getConfidence();
+		ds << c.edgeSupport << c.maxCosine << (qint32)c.numLevels << (qint32)c.numChannels << c.areaRatio << c.score;
+	}
+
+	return file.commit();
+}
+
+/**
+* Returns the entry's file path.
+* Entries are distributed to 256 sub directories to keep the directories small.
+**/
+QString DkDetectionCache::filePath(const QByteArray& key) const {
+
+	QString k = QString::fromLatin1(key);
+
+	return QDir(dirPath).absoluteFilePath(k.left(2) + "/" + k + ".pages");
+}
+
+};
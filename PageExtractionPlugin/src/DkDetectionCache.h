@@ -0,0 +1,60 @@
+/*******************************************************************************************************
+ DkDetectionCache.h
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2011-2015 Markus Diem <markus@nomacs.org>
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+#pragma once
+
+#include "DkPageSegmentationUtils.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <QByteArray>
+#include <QImage>
+#include <QString>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+/**
+* Persistent cache of detected pages.
+* Results are keyed by the image's pixels and the detection parameters. Every
+* entry is a file that is replaced atomically. Hence, concurrent batch workers
+* (or processes) can share a cache directory.
+**/
+class DkDetectionCache {
+
+public:
+	DkDetectionCache(const QString& dirPath = QString());
+
+	bool isEnabled() const;
+	static QByteArray key(const QImage& img, const QByteArray& params);
+
+	bool load(const QByteArray& key, std::vector<DkPolyRect>& rects) const;
+	bool save(const QByteArray& key, const std::vector<DkPolyRect>& rects) const;
+
+protected:
+	QString dirPath;
+
+	QString filePath(const QByteArray& key) const;
+};
+
+};
@@ -0,0 +1,282 @@
+/*******************************************************************************************************
+ DkPageCropper.cpp
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2015 Markus Diem
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+#include "DkPageCropper.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+// DkPageCropper --------------------------------------------------------------------
+DkPageCropper::DkPageCropper(const QImage& img, const QColor& bgCol) : img(img), bgCol(bgCol) {
+}
+
+/**
+* Crops the image.
+* @param tForm transforms image coordinates to the coordinates of the cropped image.
+* @param size the size of the cropped image.
+* @param smooth if true, the image is interpolated bilinearly (nearest neighbor otherwise).
+* @return the cropped image.
+**/
+QImage DkPageCropper::crop(const QTransform& tForm, const QSize& size, bool smooth) const {
+
+	bool invertible = false;
+	QTransform inv = tForm.inverted(&invertible);
+
+	if (!invertible || size.isEmpty() || img.isNull())
+		return QImage();
+
+	// source region covered by the page (+1 px for the interpolation)
+	QRect roi = inv.mapRect(QRectF(QPointF(), size)).toAlignedRect().adjusted(-1, -1, 1, 1) & img.rect();
+
+	QImage src = img;
+	QPoint offset;
+
+	// convert the page's region only
+	if (!isSupported(img.format())) {
+		src = img.copy(roi).convertToFormat(QImage::Format_ARGB32);
+		offset = roi.topLeft();
+	}
+
+	QImage cImg(size, src.format());
+
+	if (cImg.isNull()) {
+		qWarning() << "[DkPageCropper] could not allocate" << size;
+		return QImage();
+	}
+
+	uchar* dst = cImg.bits();
+	int dstBpl = cImg.bytesPerLine();
+	int width = cImg.width();
+
+	// resample bands of rows in parallel
+	cv::parallel_for_(cv::Range(0, cImg.height()), [&](const cv::Range& r) {
+
+		switch (src.depth()) {
+		case 8:		cropRows<1>(src, offset, dst, dstBpl, width, inv, smooth, r.start, r.end); break;
+		case 24:	cropRows<3>(src, offset, dst, dstBpl, width, inv, smooth, r.start, r.end); break;
+		default:	cropRows<4>(src, offset, dst, dstBpl, width, inv, smooth, r.start, r.end); break;
+		}
+	});
+
+	return cImg;
+}
+
+bool DkPageCropper::isSupported(QImage::Format format) {
+
+	return format == QImage::Format_Grayscale8 ||
+		format == QImage::Format_RGB888 ||
+		format == QImage::Format_RGB32 ||
+		format == QImage::Format_ARGB32 ||
+		format == QImage::Format_ARGB32_Premultiplied;
+}
+
+/**
+* Returns the background color in the memory layout of format.
+**/
+void DkPageCropper::background(QImage::Format format, uchar* bg) const {
+
+	switch (format) {
+	case QImage::Format_Grayscale8:
+		bg[0] = (uchar)qGray(bgCol.rgb());
+		break;
+	case QImage::Format_RGB888:
+		bg[0] = (uchar)bgCol.red();
+		bg[1] = (uchar)bgCol.green();
+		bg[2] = (uchar)bgCol.blue();
+		break;
+	default: {
+		QRgb c = format == QImage::Format_ARGB32_Premultiplied ? qPremultiply(bgCol.rgba()) : bgCol.rgba();
+		std::memcpy(bg, &c, sizeof(c));
+		break;
+	}
+	}
+}
+
+/**
+* Clips the pixel range [x0, x1) of a row to the pixels whose source coordinate s + x*ds is within [lo, hi].
+**/
+void DkPageCropper::clipRange(double s, double ds, double lo, double hi, int& x0, int& x1) {
+
+	if (std::fabs(ds) < 1e-12) {
+		if (s < lo || s > hi)
+			x1 = x0;
+		return;
+	}
+
+	double a = (lo-s)/ds;
+	double b = (hi-s)/ds;
+	if (a > b)
+		std::swap(a, b);
+
+	x0 = std::max(x0, (int)std::ceil(a));
+	x1 = std::min(x1, (int)std::floor(b) + 1);
+
+	if (x1 < x0)
+		x1 = x0;
+}
+
+/**
+* Resamples the rows [rowStart, rowEnd) of the cropped image.
+* The transform is affine, hence the pixels of a row that map into the source are a single range.
+* It is computed per row, so the interior of a row is resampled without bounds checks or 
+* branches: source coordinates are 32.32 fixed point and updated incrementally, bilinear 
+* interpolation uses 8 bit fixed point weights. Pixels close to the source's border replicate it.
+**/
+template <int cn>
+void DkPageCropper::cropRows(const QImage& src, const QPoint& offset, uchar* dst, int dstBpl, int width,
+	const QTransform& inv, bool smooth, int rowStart, int rowEnd) const {
+
+	const qint64 fixOne = (qint64)1 << 32;
+	const double margin = 1e-3;		// covers the fixed point error of the interior
+
+	const uchar* bits = src.constBits();
+	const int srcBpl = src.bytesPerLine();
+	const int sw = src.width();
+	const int sh = src.height();
+	const double dsx = inv.m11();
+	const double dsy = inv.m12();
+	const qint64 fdx = qRound64(dsx*fixOne);
+	const qint64 fdy = qRound64(dsy*fixOne);
+
+	uchar bg[4];
+	background(src.format(), bg);
+
+	for (int y = rowStart; y < rowEnd; y++) {
+
+		uchar* row = dst + (size_t)y*dstBpl;
+
+		// map pixel centers
+		QPointF sp = inv.map(QPointF(0.5, y+0.5));
+		double sx = sp.x() - 0.5 - offset.x();
+		double sy = sp.y() - 0.5 - offset.y();
+
+		// pixels within the source - the others are background
+		int in0 = 0, in1 = width;
+		clipRange(sx, dsx, -0.5, sw-0.5, in0, in1);
+		clipRange(sy, dsy, -0.5, sh-0.5, in0, in1);
+
+		// pixels whose neighbors are within the source (interior)
+		int ii0 = in0, ii1 = in1;
+		clipRange(sx, dsx, margin, sw-1-margin, ii0, ii1);
+		clipRange(sy, dsy, margin, sh-1-margin, ii0, ii1);
+
+		for (int x = 0; x < width; x++) {
+
+			if (x == in0)
+				x = in1;	// skip the source pixels
+			if (x >= width)
+				break;
+
+			for (int c = 0; c < cn; c++)
+				row[x*cn+c] = bg[c];
+		}
+
+		// border pixels - the border is replicated
+		for (int x = in0; x < in1; x++) {
+
+			if (x == ii0)
+				x = ii1;	// skip the interior
+			if (x >= in1)
+				break;
+
+			double px = sx + x*dsx;
+			double py = sy + x*dsy;
+			uchar* dp = row + x*cn;
+
+			if (!smooth) {
+				int ix = qBound(0, (int)std::floor(px+0.5), sw-1);
+				int iy = qBound(0, (int)std::floor(py+0.5), sh-1);
+				const uchar* p = bits + (size_t)iy*srcBpl + ix*cn;
+
+				for (int c = 0; c < cn; c++)
+					dp[c] = p[c];
+				continue;
+			}
+
+			int ix = (int)std::floor(px);
+			int iy = (int)std::floor(py);
+			int fx = (int)((px-ix)*256);
+			int fy = (int)((py-iy)*256);
+
+			int x0 = qBound(0, ix, sw-1);
+			int x1 = qBound(0, ix+1, sw-1);
+			const uchar* r0 = bits + (size_t)qBound(0, iy, sh-1)*srcBpl;
+			const uchar* r1 = bits + (size_t)qBound(0, iy+1, sh-1)*srcBpl;
+
+			for (int c = 0; c < cn; c++) {
+				int top = r0[x0*cn+c]*(256-fx) + r0[x1*cn+c]*fx;
+				int bottom = r1[x0*cn+c]*(256-fx) + r1[x1*cn+c]*fx;
+				dp[c] = (uchar)((top*(256-fy) + bottom*fy + (1 << 15)) >> 16);
+			}
+		}
+
+		// interior - no branches per pixel
+		qint64 fsx = qRound64((sx + ii0*dsx)*fixOne);
+		qint64 fsy = qRound64((sy + ii0*dsy)*fixOne);
+		uchar* dp = row + ii0*cn;
+
+		if (smooth) {
+
+			for (int x = ii0; x < ii1; x++, fsx += fdx, fsy += fdy, dp += cn) {
+
+				const uchar* p0 = bits + (size_t)(fsy >> 32)*srcBpl + (fsx >> 32)*cn;
+				const uchar* p1 = p0 + srcBpl;
+				int fx = (int)(fsx >> 24) & 255;
+				int fy = (int)(fsy >> 24) & 255;
+
+				for (int c = 0; c < cn; c++) {
+					int top = p0[c]*(256-fx) + p0[c+cn]*fx;
+					int bottom = p1[c]*(256-fx) + p1[c+cn]*fx;
+					dp[c] = (uchar)((top*(256-fy) + bottom*fy + (1 << 15)) >> 16);
+				}
+			}
+		}
+		else {
+
+			// nearest neighbor: floor(s + 0.5)
+			fsx += fixOne/2;
+			fsy += fixOne/2;
+
+			for (int x = ii0; x < ii1; x++, fsx += fdx, fsy += fdy, dp += cn) {
+
+				const uchar* p = bits + (size_t)(fsy >> 32)*srcBpl + (fsx >> 32)*cn;
+
+				for (int c = 0; c < cn; c++)
+					dp[c] = p[c];
+			}
+		}
+	}
+}
+
+};
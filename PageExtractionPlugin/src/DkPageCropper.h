@@ -0,0 +1,61 @@
+/*******************************************************************************************************
+ DkPageCropper.h
+
+ nomacs is a fast and small image viewer with the capability of synchronizing multiple instances
+
+ Copyright (C) 2011-2015 Markus Diem <markus@nomacs.org>
+
+ This file is part of nomacs.
+
+ nomacs is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ nomacs is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ *******************************************************************************************************/
+
+#pragma once
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <QColor>
+#include <QImage>
+#include <QTransform>
+#pragma warning(pop)		// no warnings from includes - end
+
+namespace nmp {
+
+/**
+* Crops (rotated) pages from an image.
+* Only the source region covered by the page is read and the output
+* rows are resampled in parallel. Grayscale8, RGB888 and 32 bit images
+* keep their format - all other formats are converted to ARGB32.
+**/
+class DkPageCropper {
+
+public:
+	DkPageCropper(const QImage& img, const QColor& bgCol = QColor(0, 0, 0));
+
+	QImage crop(const QTransform& tForm, const QSize& size, bool smooth = true) const;
+
+protected:
+	QImage img;
+	QColor bgCol;
+
+	static bool isSupported(QImage::Format format);
+	static void clipRange(double s, double ds, double lo, double hi, int& x0, int& x1);
+	void background(QImage::Format format, uchar* bg) const;
+
+	template <int cn>
+	void cropRows(const QImage& src, const QPoint& offset, uchar* dst, int dstBpl, int width, 
+		const QTransform& inv, bool smooth, int rowStart, int rowEnd) const;
+};
+
+};
@@ -24,6 +24,7 @@
 
 #include "DkPageExtractionPlugin.h"
 #include "DkPageSegmentation.h"
+#include "DkDetectionCache.h"
 
 #include "DkImageStorage.h"
 #include "DkMetaData.h"
@@ -38,7 +39,15 @@
 #include <QUuid>
 #include <QDateTime>
 #include <QDir>
+#include <QImageWriter>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutexLocker>
+#include <QPainter>
 #include <QSettings>
+#include <QTextStream>
+
+#include <numeric>
 
 #include <QXmlStreamReader>
 #pragma warning(pop)		// no warnings from includes - end
@@ -65,7 +74,8 @@ DkPageExtractionPlugin::DkPageExtractionPlugin(QObject* parent) : QObject(parent
 	menuNames[id_crop_to_page] = tr("Crop to Page");
 	menuNames[id_crop_to_metadata] = tr("Crop to Metadata");
 	menuNames[id_draw_to_page] = tr("Draw to Page");
-	//menuNames[id_eval_page] = tr("Evaluate Page");
+	menuNames[id_crop_to_pages] = tr("Crop to Pages");
+	menuNames[id_eval_page] = tr("Evaluate Page");
 	mMenuNames = menuNames.toList();
 
 	// create menu status tips
@@ -75,12 +85,10 @@ DkPageExtractionPlugin::DkPageExtractionPlugin(QObject* parent) : QObject(parent
 	statusTips[id_crop_to_page] = tr("Finds a page in a document image and then crops the image to that page.");
 	statusTips[id_crop_to_metadata] = tr("Finds a page in a document image and then saves the coordinates to the XMP metadata.");
 	statusTips[id_draw_to_page] = tr("Finds a page in a document image and then draws the found document boundaries.");
-	//statusTips[id_eval_page] = tr("Loads GT and computes the Jaccard index.");
+	statusTips[id_crop_to_pages] = tr("Finds all pages in a document image (e.g. book spreads) and saves one image per page.");
+	statusTips[id_eval_page] = tr("Loads GT and computes the Jaccard index.");
 	mMenuStatusTips = statusTips.toList();
 
-	//QFileInfo resPath(QDir("dmrz/numerical-results/"), "results-" + QDateTime::currentDateTime().toString("yyyy-MM-dd HH-mm-ss") + ".txt");
-	//mResultPath = resPath.absoluteFilePath();
-
 	// save default settings
 	nmc::DefaultSettings settings;
 	loadSettings(settings);
@@ -136,17 +144,95 @@ QSharedPointer<nmc::DkImageContainer> DkPageExtractionPlugin::runPlugin(
 
 	if (!mRunIDs.contains(runID) || !imgC)
 		return imgC;
+
+	// images that an interrupted run wrote in place are its output already - applying the action again would e.g. crop them twice
+	QFileInfo fileInfo(imgC->filePath());
+	bool inPlace = QFileInfo(saveInfo.outputFilePath()) == fileInfo;
+	bool written = false;
+	std::vector<DkPolyRect> journalRects;
+	bool journaled = mJournal.isOpen() && mJournal.find(fileInfo, journalRects, inPlace, &written);
+
+	if (journaled && written) {
+		qDebug() << fileInfo.fileName() << "was written by an interrupted run - skipped";
+		return imgC;
+	}
 		
-	cv::Mat img = nmc::DkImage::qImage2Mat(imgC->image());
+	// the segmentation wraps the image's buffer - no full resolution copy is made
+	// note: the batch decodes the image before runPlugin is called, so we cannot decode a reduced resolution proxy
+	const QImage& qImg = imgC->image();
 	bool alternativeMethod = mMethod == m_bhaskar;
 	
-	DkPageSegmentation segM(img, alternativeMethod);
+	DkPageSegmentation segM(qImg, alternativeMethod, mConfig);
+
+	// the planes of grayscale sources are redundant
+	segM.setGrayscaleSource(qImg.format() == QImage::Format_Grayscale8 || 
+		(qImg.format() == QImage::Format_Indexed8 && qImg.isGrayscale()));
+	segM.setEnsemble(mMethod == m_ensemble);
+	segM.setSearchRegion(searchRegion(imgC, qImg.size()));
+
+	if (mConfig.tracking) {
+		QMutexLocker locker(&mTrackMutex);
+		if (mTrackedSize == qImg.size())
+			segM.setPrior(mTrackedPage, mTrackedContrasts);
+	}
+
+	if (mConfig.backgroundModel) {
+		QMutexLocker locker(&mBackgroundMutex);
+		if (mBackground.isTrained())
+			segM.setBackground(mBackground);
+	}
+
+	// results of the tracking & background modes depend on previous images - they are not cached
+	// neither are results that depend on the image's XMP rect
+	DkDetectionCache cache(mConfig.tracking || mConfig.backgroundModel || mXmpSearchRegion ? QString() : mCacheDir);
+	QByteArray cacheKey;
+	std::vector<DkPolyRect> cachedRects;
+
+	if (cache.isEnabled() && !journaled)
+		cacheKey = DkDetectionCache::key(qImg, mConfig.fingerprint() + QByteArray::number(mMethod));
 
 	// run the page segmentation
 	nmc::DkTimer dt;
-	segM.compute();
-	segM.filterDuplicates();
-	qDebug() << "page segmentation takes" << dt;
+	if (journaled) {
+		segM.setRects(journalRects);
+		qDebug() << "journaled pages of" << fileInfo.fileName() << "reused";
+	}
+	else if (cache.isEnabled() && cache.load(cacheKey, cachedRects)) {
+		segM.setRects(cachedRects);
+		qDebug() << "cached pages loaded in" << dt;
+	}
+	else {
+		segM.compute();
+		segM.filterDuplicates();
+		if (mConfig.refineCorners)
+			segM.refineCorners();
+		segM.computeConfidence();
+		qDebug() << "page segmentation takes" << dt << "confidence:" << segM.getMaxRect().getConfidence().score;
+		qDebug() << "stages -" << segM.getStats().toString();
+
+		if (cache.isEnabled())
+			cache.save(cacheKey, segM.getRects());
+	}
+
+	int detectionTime = dt.elapsed();
+
+	if (mJournal.isOpen() && !journaled)
+		mJournal.append(fileInfo, segM.getRects(), detectionTime);
+
+	// the next image tracks this page
+	if (mConfig.tracking) {
+		QMutexLocker locker(&mTrackMutex);
+		mTrackedPage = segM.getMaxRect();
+		mTrackedContrasts = segM.edgeContrasts(mTrackedPage);
+		mTrackedSize = qImg.size();
+	}
+
+	// learn the background from the first images - their pages are masked
+	if (mConfig.backgroundModel) {
+		QMutexLocker locker(&mBackgroundMutex);
+		if (!mBackground.isTrained())
+			mBackground.addSample(segM.getImage(), segM.getMaxRect());
+	}
 
 	// crop image
 	if(runID == mRunIDs[id_crop_to_page]) {
@@ -171,52 +257,166 @@ QSharedPointer<nmc::DkImageContainer> DkPageExtractionPlugin::runPlugin(
 		segM.draw(dImg);
 		imgC->setImage(dImg, tr("Page Annotated"));
 	}
-	//else if (runID == mRunIDs[id_eval_page]) {
+	// crop to all pages - the first page replaces the image, the others are saved next to it
+	else if(runID == mRunIDs[id_crop_to_pages]) {
+
+		std::vector<DkPolyRect> pages = segM.getPages(mConfig.maxPages);
+		QImage img = imgC->image();
+
+		if (!pages.empty())
+			imgC->setImage(segM.getCropped(img, pages[0]), tr("Page Cropped"));
+
+		if (pages.size() > 1 && saveInfo.outputFilePath().isEmpty())
+			qWarning() << "[Page Extraction] no output path -" << pages.size()-1 << "pages are not saved";
+
+		// the additional pages follow the batch's save settings (no output, skip existing, quality)
+		bool saveOutput = !saveInfo.outputFilePath().isEmpty() && saveInfo.mode() != nmc::DkSaveInfo::mode_do_not_save_output;
+		QSharedPointer<DkPageWriteInfo> info(new DkPageWriteInfo(runID, imgC->filePath()));
+
+		for (size_t idx = 1; idx < pages.size() && saveOutput; idx++) {
+
+			QString filePath = pageFilePath(saveInfo.outputFilePath(), (int)idx);
+
+			if (saveInfo.mode() == nmc::DkSaveInfo::mode_skip_existing && QFileInfo(filePath).exists()) {
+				qDebug() << "[Page Extraction]" << filePath << "exists - skipped";
+				continue;
+			}
+
+			if (!savePage(segM.getCropped(img, pages[idx]), filePath, saveInfo))
+				info->failedPaths << filePath;
+		}
 
-	//	QImage dImg = imgC->image();
+		if (!info->failedPaths.empty())
+			batchInfo = info;
+	}
+	// compare with the ground truth - the results are aggregated in postLoadPlugin
+	else if (runID == mRunIDs[id_eval_page]) {
 
-	//	QPolygonF gt = readGT(imgC->filePath());
-	//	
-	//	QPen pen(QColor(100, 200, 50));
-	//	pen.setWidth(10);
-	//	QPainter p(&dImg);
-	//	p.setPen(pen);
-	//	p.drawPolygon(gt);
-	//	p.end();
+		QImage dImg = imgC->image();
+		QPolygonF gt = readGT(imgC->filePath());
 
-	//	segM.draw(dImg);
-	//	imgC->setImage(dImg, tr("Result vs GT"));
+		QSharedPointer<DkPageEvalInfo> info(new DkPageEvalInfo(runID, imgC->filePath()));
+		info->hasGT = !gt.isEmpty();
+		info->pageFound = !segM.getRects().empty();
+		info->numPages = (int)segM.getRects().size();
+		info->time = detectionTime;
+		info->stats = segM.getStats();
+		info->outputDir = QFileInfo(saveInfo.outputFilePath()).absolutePath();
 
-	//	double ji = jaccardIndex(imgC->image().size(), gt, segM.getMaxRect().toPolygon());
+		if (info->hasGT && info->pageFound)
+			info->iou = jaccardIndex(gt, segM.getMaxRect().toPolygon());
 
-	//	QString data = imgC->fileName() + ", " + QString::number(ji) + "\n";
-	//	qDebug() << data;
+		batchInfo = info;
 
-	//	QFile file(mResultPath);
-	//	file.open(QIODevice::WriteOnly | QIODevice::Append);
-	//	QTextStream stream(&file);
-	//	stream << data;
-	//	qInfo() << "results written to" << mResultPath;
+		QPen pen(QColor(100, 200, 50));
+		pen.setWidth(10);
+		QPainter p(&dImg);
+		p.setPen(pen);
+		p.drawPolygon(gt);
+		p.end();
 
-	//}
+		segM.draw(dImg);
+		imgC->setImage(dImg, tr("Result vs GT"));
+	}
 
 	// wrong runID? - do nothing
 	return imgC;
 }
 
+/**
+* Resets the tracked page and the background and opens the journal before a new batch is processed.
+**/
+void DkPageExtractionPlugin::preLoadPlugin() const {
+
+	QMutexLocker locker(&mTrackMutex);
+	mTrackedPage = DkPolyRect();
+	mTrackedContrasts.clear();
+	mTrackedSize = QSize();
+	locker.unlock();
+
+	resetBackground();
+
+	if (!mJournalPath.isEmpty())
+		mJournal.open(mJournalPath, mConfig.fingerprint() + QByteArray::number(mMethod));
+
+	mBatchTimer.start();
+}
+
+/**
+* Flushes and compacts the journal and writes the evaluation report after a batch.
+**/
+void DkPageExtractionPlugin::postLoadPlugin(const QVector<QSharedPointer<nmc::DkBatchInfo> > & batchInfo) const {
+
+	mJournal.close();
+
+	QVector<QSharedPointer<DkPageEvalInfo> > results;
+	QStringList failedPaths;
+	for (const QSharedPointer<nmc::DkBatchInfo>& bi : batchInfo) {
+
+		QSharedPointer<DkPageEvalInfo> ei = qSharedPointerDynamicCast<DkPageEvalInfo>(bi);
+		if (ei)
+			results << ei;
+
+		QSharedPointer<DkPageWriteInfo> wi = qSharedPointerDynamicCast<DkPageWriteInfo>(bi);
+		if (wi)
+			failedPaths << wi->failedPaths;
+	}
+
+	if (!results.empty())
+		writeEvalReport(results);
+
+	if (!failedPaths.empty())
+		qWarning() << "[Page Extraction]" << failedPaths.size() << "additional pages could not be saved:" << failedPaths;
+}
+
+/**
+* Clears the background model.
+* If a calibration image is set, the background is learned from it. Otherwise,
+* it is learned from the first images that are processed.
+**/
+void DkPageExtractionPlugin::resetBackground() const {
+
+	QMutexLocker locker(&mBackgroundMutex);
+	mBackground = DkBackgroundModel(mConfig.backgroundSamples);
+
+	if (!mConfig.backgroundModel || mConfig.backgroundImage.isEmpty())
+		return;
+
+	QImage bgImg(mConfig.backgroundImage);
+
+	if (bgImg.isNull()) {
+		qWarning() << "[Page Extraction] could not load the background image" << mConfig.backgroundImage;
+		return;
+	}
+
+	mBackground.setImage(nmc::DkImage::qImage2Mat(bgImg));
+}
+
 void DkPageExtractionPlugin::loadSettings(QSettings & settings) {
 
 	settings.beginGroup(name());
 	int mIdx = settings.value("Method", mMethod).toInt();
 	if (mIdx >= 0 && mIdx < m_end)
 		mMethod = (MethodIndex)mIdx;
+	mConfig.loadSettings(settings);
+	mCacheDir = settings.value("CacheDir", mCacheDir).toString();
+	mJournalPath = settings.value("Journal", mJournalPath).toString();
+	mResultPath = settings.value("EvalReportDir", mResultPath).toString();
+	mXmpSearchRegion = settings.value("SearchXmpRect", mXmpSearchRegion).toBool();
 	settings.endGroup();
+
+	resetBackground();
 }
 
 void DkPageExtractionPlugin::saveSettings(QSettings & settings) const {
 
 	settings.beginGroup(name());
 	settings.setValue("Method", mMethod);
+	mConfig.saveSettings(settings);
+	settings.setValue("CacheDir", mCacheDir);
+	settings.setValue("Journal", mJournalPath);
+	settings.setValue("EvalReportDir", mResultPath);
+	settings.setValue("SearchXmpRect", mXmpSearchRegion);
 	settings.endGroup();
 }
 
@@ -259,27 +459,201 @@ QPolygonF DkPageExtractionPlugin::readGT(const QString& imgPath) const {
 	return rect;
 }
 
-double DkPageExtractionPlugin::jaccardIndex(const QSize & imgSize, const QPolygonF & gt, const QPolygonF & computed) const {
+/**
+* Computes the Jaccard index (intersection over union) of two polygons.
+* The intersection is computed analytically - no polygons are rendered.
+**/
+double DkPageExtractionPlugin::jaccardIndex(const QPolygonF & gt, const QPolygonF & computed) const {
 	
-	cv::Mat gtImg = nmc::DkImage::qImage2Mat(drawPoly(imgSize, gt));
-	cv::Mat evImg = nmc::DkImage::qImage2Mat(drawPoly(imgSize, computed));
+	auto toRect = [](const QPolygonF& poly) {
+
+		std::vector<nmc::DkVector> pts;
+		for (const QPointF& p : poly)
+			pts.push_back(nmc::DkVector((float)p.x(), (float)p.y()));
+
+		// closed polygons repeat the first point
+		if (pts.size() > 1 && pts.front().x == pts.back().x && pts.front().y == pts.back().y)
+			pts.pop_back();
+
+		return DkPolyRect(pts);
+	};
+
+	DkPolyRect gtRect = toRect(gt);
+	DkPolyRect cRect = toRect(computed);
+
+	double inter = std::abs(gtRect.intersectArea(cRect));
+	double uni = gtRect.getAreaConst() + cRect.getAreaConst() - inter;
+
+	return uni > 0 ? inter/uni : 0.0;
+}
+
+/**
+* Writes the evaluation results of a batch.
+* A CSV file lists all images, a JSON file holds the aggregated results.
+**/
+void DkPageExtractionPlugin::writeEvalReport(const QVector<QSharedPointer<DkPageEvalInfo> >& results) const {
+
+	QString dirPath = mResultPath.isEmpty() ? results.first()->outputDir : mResultPath;
+	QString baseName = "page-evaluation-" + QDateTime::currentDateTime().toString("yyyy-MM-dd HH-mm-ss");
+	QDir().mkpath(dirPath);
+
+	int numGT = 0, numFound = 0, numFailed = 0;
+	double detectionTime = 0;
+	std::vector<double> stageTimes(DkSegmentationStats::stage_end, 0.0);
+	std::vector<double> ious;
+
+	QFile csvFile(QDir(dirPath).absoluteFilePath(baseName + ".csv"));
+	if (!csvFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
+		qWarning() << "[Page Extraction] could not write" << csvFile.fileName();
+		return;
+	}
+
+	QTextStream csv(&csvFile);
+	csv << "file, gt, page found, pages, jaccard, time [ms]\n";
+
+	for (const QSharedPointer<DkPageEvalInfo>& r : results) {
+
+		// paths might contain commas or quotes
+		QString path = r->filePath();
+		path.replace("\"", "\"\"");
+
+		csv << "\"" << path << "\", " << (int)r->hasGT << ", " << (int)r->pageFound << ", " 
+			<< r->numPages << ", " << r->iou << ", " << r->time << "\n";
+
+		detectionTime += r->time;
+
+		for (int sIdx = 0; sIdx < DkSegmentationStats::stage_end; sIdx++)
+			stageTimes[sIdx] += r->stats.time((DkSegmentationStats::Stage)sIdx);
+
+		if (r->pageFound)
+			numFound++;
+
+		if (!r->hasGT)
+			continue;
+
+		numGT++;
+		ious.push_back(r->iou);
+
+		if (!r->pageFound)
+			numFailed++;
+	}
+
+	std::sort(ious.begin(), ious.end());
+	auto fractionAbove = [&ious](double t) {
+		return ious.empty() ? 0.0 : (double)(ious.end() - std::upper_bound(ious.begin(), ious.end(), t)) / ious.size();
+	};
+
+	// the mean of both middle values if the number is even
+	double medianIou = 0.0;
+	if (!ious.empty())
+		medianIou = ious.size() % 2 ? ious[ious.size()/2] : 0.5*(ious[ious.size()/2-1] + ious[ious.size()/2]);
+
+	double wallTime = mBatchTimer.isValid() ? mBatchTimer.elapsed()/1000.0 : 0.0;
+
+	QJsonObject summary;
+	summary["method"] = (int)mMethod;
+	summary["preset"] = DkPageSegmentationConfig::presetName(mConfig.preset);
+	summary["images"] = results.size();
+	summary["imagesWithGT"] = numGT;
+	summary["pagesFound"] = numFound;
+	summary["failures"] = numFailed;	// GT but no page
+	summary["meanJaccard"] = ious.empty() ? 0.0 : std::accumulate(ious.begin(), ious.end(), 0.0) / ious.size();
+	summary["medianJaccard"] = medianIou;
+	summary["jaccardAbove0.9"] = fractionAbove(0.9);
+	summary["jaccardAbove0.95"] = fractionAbove(0.95);
+	summary["detectionTimeMs"] = detectionTime;
+	summary["meanDetectionTimeMs"] = detectionTime / results.size();
+	summary["wallTimeS"] = wallTime;
+	summary["imagesPerS"] = wallTime > 0 ? results.size() / wallTime : 0.0;
+
+	// mean time per image of each stage
+	QJsonObject stages;
+	for (int sIdx = 0; sIdx < DkSegmentationStats::stage_end; sIdx++) {
+		if (stageTimes[sIdx] > 0)
+			stages[DkSegmentationStats::stageName((DkSegmentationStats::Stage)sIdx)] = stageTimes[sIdx] / results.size();
+	}
+	summary["meanStageTimeMs"] = stages;
+
+	QFile jsonFile(QDir(dirPath).absoluteFilePath(baseName + ".json"));
+	if (!jsonFile.open(QIODevice::WriteOnly)) {
+		qWarning() << "[Page Extraction] could not write" << jsonFile.fileName();
+		return;
+	}
+
+	jsonFile.write(QJsonDocument(summary).toJson());
+	qInfo() << "evaluation report written to" << jsonFile.fileName();
+}
+
+/**
+* Returns the file path of an additional page.
+* @param filePath the output file path of the image.
+* @param pageIdx the page's index (0 is the image itself).
+* @return e.g. dir/name-page2.jpg for pageIdx 1.
+**/
+QString DkPageExtractionPlugin::pageFilePath(const QString& filePath, int pageIdx) const {
+
+	QFileInfo fi(filePath);
+	QString fileName = fi.completeBaseName() + "-page" + QString::number(pageIdx+1);
+
+	if (!fi.suffix().isEmpty())
+		fileName += "." + fi.suffix();
+
+	return QFileInfo(fi.absoluteDir(), fileName).absoluteFilePath();
+}
+
+/**
+* Saves an additional page of Crop to Pages.
+* The batch's compression is used as quality (like nomacs does when it saves the image itself).
+* @return false if the page could not be written.
+**/
+bool DkPageExtractionPlugin::savePage(const QImage& img, const QString& filePath, const nmc::DkSaveInfo& saveInfo) const {
+
+	QImageWriter writer(filePath);
+
+	if (saveInfo.compression() >= 0)
+		writer.setQuality(saveInfo.compression());
 
-	double andVal = (double)cv::sum(gtImg & evImg)[0];
-	double orVal = (double)cv::sum(gtImg | evImg)[0];
+	if (!writer.write(img)) {
+		qWarning() << "[Page Extraction] could not save" << filePath << writer.errorString();
+		return false;
+	}
 
-	return andVal/orVal;
+	return true;
 }
 
-QImage DkPageExtractionPlugin::drawPoly(const QSize & imgSize, const QPolygonF & poly) const {
+/**
+* Returns the region the page is searched in: the XMP crop rect of a previous run 
+* (SearchXmpRect) or the SearchRect. An empty rect means the whole image.
+* @param size the size of the segmented image.
+**/
+DkPolyRect DkPageExtractionPlugin::searchRegion(QSharedPointer<nmc::DkImageContainer> imgC, const QSize& size) const {
 
-	QImage img(imgSize, QImage::Format_RGB888);
-	img.fill(QColor(0, 0, 0));
+	QPolygonF poly;
 
-	QPainter pg(&img);
-	pg.setBrush(QColor(255, 255, 255));
-	pg.drawPolygon(poly);
+	if (mXmpSearchRegion) {
+		nmc::DkRotatingRect rr = imgC->getMetaData()->getXMPRect(size);
+		if (!rr.isEmpty())
+			poly = rr.getPoly();
+	}
+
+	if (poly.isEmpty() && mConfig.searchRect.isValid()) {
+		const QRectF& r = mConfig.searchRect;
+		poly = QPolygonF(QRectF(r.x()*size.width(), r.y()*size.height(), r.width()*size.width(), r.height()*size.height()));
+	}
+
+	std::vector<nmc::DkVector> pts;
+	for (int idx = 0; idx < poly.size() && idx < DkPolyRect::max_corners; idx++)
+		pts.push_back(nmc::DkVector((float)poly[idx].x(), (float)poly[idx].y()));
+
+	return pts.size() == DkPolyRect::max_corners ? DkPolyRect(pts) : DkPolyRect();
+}
+
+// DkPageEvalInfo --------------------------------------------------------------------
+DkPageEvalInfo::DkPageEvalInfo(const QString& id, const QString& filePath) : nmc::DkBatchInfo(id, filePath) {
+}
 
-	return img;
+// DkPageWriteInfo --------------------------------------------------------------------
+DkPageWriteInfo::DkPageWriteInfo(const QString& id, const QString& filePath) : nmc::DkBatchInfo(id, filePath) {
 }
 
 
@@ -25,9 +25,44 @@
 #pragma once
 
 #include "DkPluginInterface.h"
+#include "DkPageSegmentation.h"
+#include "DkBatchJournal.h"
+
+#pragma warning(push, 0)	// no warnings from includes - begin
+#include <QElapsedTimer>
+#include <QMutex>
+#pragma warning(pop)		// no warnings from includes - end
 
 namespace nmp {
 
+/**
+* Evaluation result of a single image (see the Evaluate Page action).
+**/
+class DkPageEvalInfo : public nmc::DkBatchInfo {
+
+public:
+	DkPageEvalInfo(const QString& id = QString(), const QString& filePath = QString());
+
+	bool hasGT = false;		// ground truth found
+	bool pageFound = false;
+	int numPages = 0;
+	double iou = 0;			// Jaccard index of the page and the ground truth
+	int time = 0;			// [ms] detection
+	DkSegmentationStats stats;
+	QString outputDir;
+};
+
+/**
+* Additional pages of an image that could not be saved (see the Crop to Pages action).
+**/
+class DkPageWriteInfo : public nmc::DkBatchInfo {
+
+public:
+	DkPageWriteInfo(const QString& id = QString(), const QString& filePath = QString());
+
+	QStringList failedPaths;
+};
+
 class DkPageExtractionPlugin : public QObject, nmc::DkBatchPluginInterface {
 	Q_OBJECT
 	Q_INTERFACES(nmc::DkBatchPluginInterface)
@@ -50,14 +85,15 @@ public:
 		const nmc::DkSaveInfo& saveInfo,
 		QSharedPointer<nmc::DkBatchInfo>& batchInfo) const override;
 
-	virtual void preLoadPlugin() const {};	// is called before batch processing
-	virtual void postLoadPlugin(const QVector<QSharedPointer<nmc::DkBatchInfo> > & batchInfo) const {};	// is called after batch processing
+	virtual void preLoadPlugin() const;	// is called before batch processing
+	virtual void postLoadPlugin(const QVector<QSharedPointer<nmc::DkBatchInfo> > & batchInfo) const;	// is called after batch processing
 
 	enum {
 		id_crop_to_page,
 		id_crop_to_metadata,
 		id_draw_to_page,
-		//id_eval_page,
+		id_crop_to_pages,
+		id_eval_page,
 		// add actions here
 
 		id_end
@@ -66,6 +102,7 @@ public:
 	enum MethodIndex {
 		m_thresholds = 0,
 		m_bhaskar,
+		m_ensemble,
 
 		m_end
 	};
@@ -81,10 +118,32 @@ protected:
 	QString mResultPath;
 
 	MethodIndex mMethod = m_thresholds;
+	DkPageSegmentationConfig mConfig;
+	QString mCacheDir;
+	QString mJournalPath;
+	bool mXmpSearchRegion = false;
+	mutable QElapsedTimer mBatchTimer;
+
+	// images processed (restarts skip them)
+	mutable DkBatchJournal mJournal;
+
+	// tracking mode: the page of the previous image
+	mutable QMutex mTrackMutex;
+	mutable DkPolyRect mTrackedPage;
+	mutable std::vector<float> mTrackedContrasts;
+	mutable QSize mTrackedSize;
+
+	// background mode: the background of the setup
+	mutable QMutex mBackgroundMutex;
+	mutable DkBackgroundModel mBackground;
 
 	QPolygonF readGT(const QString& imgPath) const;
-	double jaccardIndex(const QSize& imgSize, const QPolygonF& gt, const QPolygonF& computed) const;
-	QImage drawPoly(const QSize& imgSize, const QPolygonF& poly) const;
+	double jaccardIndex(const QPolygonF& gt, const QPolygonF& computed) const;
+	void writeEvalReport(const QVector<QSharedPointer<DkPageEvalInfo> >& results) const;
+	QString pageFilePath(const QString& filePath, int pageIdx) const;
+	bool savePage(const QImage& img, const QString& filePath, const nmc::DkSaveInfo& saveInfo) const;
+	DkPolyRect searchRegion(QSharedPointer<nmc::DkImageContainer> imgC, const QSize& size) const;
+	void resetBackground() const;
 };
 
 };
@@ -24,30 +24,299 @@
 
 #include "DkPageSegmentation.h"
 #include "DkPageSegmentationUtils.h"
+#include "DkPageCropper.h"
 #include "DkMath.h"	// nomacs
 
 #pragma warning(push, 0)	// no warnings from includes - begin
+#include <QDataStream>
 #include <QDebug>
 #include <QPainter>
+#include <QThreadPool>
+#include <QtConcurrentRun>
 
+#include <algorithm>
+
+#include <opencv2/core/utility.hpp>
 #include <opencv2/imgproc/imgproc_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #pragma warning(pop)		// no warnings from includes - end
 
 namespace nmp {
 
+// DkSegmentationContext --------------------------------------------------------------------
+/**
+* Returns the context of the calling thread.
+* Its buffers are kept until the thread terminates.
+**/
+DkSegmentationContext& DkSegmentationContext::threadContext() {
+
+	static thread_local DkSegmentationContext ctx;
+	return ctx;
+}
+
+// DkPageSegmentationConfig --------------------------------------------------------------------
+DkPageSegmentationConfig::DkPageSegmentationConfig(Preset preset) : preset(preset) {
+
+	switch (preset) {
+	case preset_fast:
+		numThresh = 4;
+		workingWidth = 640;
+		workingHeight = 500;
+		anytime = true;
+		refineCorners = true;	// compensates the lower working resolution
+		break;
+	case preset_accurate:
+		numThresh = 32;
+		workingWidth = 1280;
+		workingHeight = 1000;
+		looseDetection = true;
+		refineCorners = true;
+		break;
+	default:
+		// balanced: the defaults
+		break;
+	}
+}
+
+/**
+* Loads the preset and applies all parameters that are overridden in the settings.
+* The settings' group needs to be set by the caller.
+**/
+void DkPageSegmentationConfig::loadSettings(QSettings& settings) {
+
+	*this = DkPageSegmentationConfig(presetFromName(settings.value("Preset", presetName(preset)).toString()));
+
+	thresh = settings.value("CannyThreshold", thresh).toInt();
+	numThresh = qMax(settings.value("NumThresholds", numThresh).toInt(), 1);	// level 0 is Canny
+	minArea = settings.value("MinArea", minArea).toDouble();
+	maxArea = settings.value("MaxArea", maxArea).toDouble();
+	maxSide = settings.value("MaxSide", maxSide).toFloat();
+	maxSideFactor = settings.value("MaxSideFactor", maxSideFactor).toFloat();
+	workingWidth = qMax(settings.value("WorkingWidth", workingWidth).toInt(), 1);
+	workingHeight = qMax(settings.value("WorkingHeight", workingHeight).toInt(), 1);
+	looseDetection = settings.value("LooseDetection", looseDetection).toBool();
+	refineCorners = settings.value("RefineCorners", refineCorners).toBool();
+	anytime = settings.value("Anytime", anytime).toBool();
+	timeBudget = settings.value("TimeBudget", timeBudget).toDouble();
+	confidentCosine = settings.value("ConfidentCosine", confidentCosine).toDouble();
+	greedyNms = settings.value("GreedyNMS", greedyNms).toBool();
+	maxChannels = qMax(settings.value("MaxChannels", maxChannels).toInt(), 0);
+	cascade = settings.value("Cascade", cascade).toBool();
+	cascadeConfidence = settings.value("CascadeConfidence", cascadeConfidence).toDouble();
+	maxPages = qMax(settings.value("MaxPages", maxPages).toInt(), 0);
+	tracking = settings.value("Tracking", tracking).toBool();
+	trackingBand = settings.value("TrackingBand", trackingBand).toFloat();
+	trackingSupport = settings.value("TrackingSupport", trackingSupport).toDouble();
+	backgroundModel = settings.value("BackgroundModel", backgroundModel).toBool();
+	backgroundSamples = qMax(settings.value("BackgroundSamples", backgroundSamples).toInt(), 1);
+	backgroundImage = settings.value("BackgroundImage", backgroundImage).toString();
+	searchRect = settings.value("SearchRect", searchRect).toRectF();
+	searchTolerance = settings.value("SearchTolerance", searchTolerance).toFloat();
+	angleTolerance = settings.value("AngleTolerance", angleTolerance).toDouble();
+}
+
+/**
+* Saves the preset and all parameters that differ from the preset.
+* The settings' group needs to be set by the caller.
+**/
+void DkPageSegmentationConfig::saveSettings(QSettings& settings) const {
+
+	const DkPageSegmentationConfig pc(preset);
+
+	// only overridden values are written - otherwise changing the preset would have no effect
+	auto save = [&settings](const QString& key, const QVariant& val, const QVariant& presetVal) {
+
+		if (val != presetVal)
+			settings.setValue(key, val);
+		else
+			settings.remove(key);
+	};
+
+	settings.setValue("Preset", presetName(preset));
+	save("CannyThreshold", thresh, pc.thresh);
+	save("NumThresholds", numThresh, pc.numThresh);
+	save("MinArea", minArea, pc.minArea);
+	save("MaxArea", maxArea, pc.maxArea);
+	save("MaxSide", maxSide, pc.maxSide);
+	save("MaxSideFactor", maxSideFactor, pc.maxSideFactor);
+	save("WorkingWidth", workingWidth, pc.workingWidth);
+	save("WorkingHeight", workingHeight, pc.workingHeight);
+	save("LooseDetection", looseDetection, pc.looseDetection);
+	save("RefineCorners", refineCorners, pc.refineCorners);
+	save("Anytime", anytime, pc.anytime);
+	save("TimeBudget", timeBudget, pc.timeBudget);
+	save("ConfidentCosine", confidentCosine, pc.confidentCosine);
+	save("GreedyNMS", greedyNms, pc.greedyNms);
+	save("MaxChannels", maxChannels, pc.maxChannels);
+	save("Cascade", cascade, pc.cascade);
+	save("CascadeConfidence", cascadeConfidence, pc.cascadeConfidence);
+	save("MaxPages", maxPages, pc.maxPages);
+	save("Tracking", tracking, pc.tracking);
+	save("TrackingBand", trackingBand, pc.trackingBand);
+	save("TrackingSupport", trackingSupport, pc.trackingSupport);
+	save("BackgroundModel", backgroundModel, pc.backgroundModel);
+	save("BackgroundSamples", backgroundSamples, pc.backgroundSamples);
+	save("BackgroundImage", backgroundImage, pc.backgroundImage);
+	save("SearchRect", searchRect, pc.searchRect);
+	save("SearchTolerance", searchTolerance, pc.searchTolerance);
+	save("AngleTolerance", angleTolerance, pc.angleTolerance);
+}
+
+/**
+* Returns a fingerprint of all parameters that change the results (e.g. to cache them).
+**/
+QByteArray DkPageSegmentationConfig::fingerprint() const {
+
+	QByteArray fp;
+	QDataStream ds(&fp, QIODevice::WriteOnly);
+
+	ds << (qint32)preset << thresh << numThresh << minArea << maxArea << maxSide << maxSideFactor
+		<< workingWidth << workingHeight << looseDetection << refineCorners
+		<< anytime << timeBudget << confidentCosine << greedyNms << maxChannels << cascade 
+		<< cascadeConfidence << maxPages << tracking << trackingBand << trackingSupport
+		<< backgroundModel << backgroundSamples << backgroundImage << searchRect << searchTolerance 
+		<< angleTolerance;
+
+	return fp;
+}
+
+QString DkPageSegmentationConfig::presetName(Preset preset) {
+
+	switch (preset) {
+	case preset_fast:		return "fast";
+	case preset_accurate:	return "accurate";
+	default:				return "balanced";
+	}
+}
+
+DkPageSegmentationConfig::Preset DkPageSegmentationConfig::presetFromName(const QString& name) {
+
+	for (int idx = 0; idx < preset_end; idx++) {
+		if (name.compare(presetName((Preset)idx), Qt::CaseInsensitive) == 0)
+			return (Preset)idx;
+	}
+
+	qWarning() << "[DkPageSegmentationConfig] unknown preset" << name << "- using balanced";
+
+	return preset_balanced;
+}
+
 // DkSegmentBurger --------------------------------------------------------------------
 // This code is based on OpenCV's rectangle sample (squares.cpp)
-DkPageSegmentation::DkPageSegmentation(const cv::Mat& colImg /* = cv::Mat */, bool alternativeMethod /* = false */) : alternativeMethod(alternativeMethod) {
+DkPageSegmentation::DkPageSegmentation(const cv::Mat& colImg /* = cv::Mat */, bool alternativeMethod /* = false */, const DkPageSegmentationConfig& config /* = DkPageSegmentationConfig() */) 
+	: alternativeMethod(alternativeMethod), config(config) {
 
 	this->img = colImg;
 }
 
+/**
+* Segments a QImage without copying it.
+* img wraps the QImage's buffer: the working image is resized from it in 
+* a single pass and only narrow bands are read at full resolution (refineCorners).
+* Formats that OpenCV cannot wrap are converted to ARGB32 (or Grayscale8).
+**/
+DkPageSegmentation::DkPageSegmentation(const QImage& img, bool alternativeMethod, const DkPageSegmentationConfig& config) 
+	: alternativeMethod(alternativeMethod), config(config) {
+
+	switch (img.format()) {
+	case QImage::Format_RGB32:
+	case QImage::Format_ARGB32:
+	case QImage::Format_ARGB32_Premultiplied:
+	case QImage::Format_RGB888:
+	case QImage::Format_Grayscale8:
+		qImg = img;		// shallow copy
+		break;
+	case QImage::Format_Indexed8:
+		qImg = img.convertToFormat(img.isGrayscale() ? QImage::Format_Grayscale8 : QImage::Format_ARGB32);
+		break;
+	default:
+		qImg = img.convertToFormat(QImage::Format_ARGB32);
+	}
+
+	if (qImg.isNull())
+		return;
+
+	int type = qImg.depth() == 32 ? CV_8UC4 : (qImg.depth() == 24 ? CV_8UC3 : CV_8UC1);
+
+	// constBits() does not detach - the segmentation never writes to img
+	this->img = cv::Mat(qImg.height(), qImg.width(), type, (void*)qImg.constBits(), qImg.bytesPerLine());
+}
+
 cv::Mat DkPageSegmentation::getDebugImg() const {
 
 	return dbgImg;	// is NULL if releaseDebug is DK_RELEASE_IMGS
 }
 
+/**
+* Returns the full resolution image.
+* Note: it might wrap the QImage passed to the constructor - do not modify it.
+**/
+cv::Mat DkPageSegmentation::getImage() const {
+	return img;
+}
+
+void DkPageSegmentation::setConfig(const DkPageSegmentationConfig& config) {
+	this->config = config;
+}
+
+/**
+* Sets the rects (e.g. cached results) instead of computing them.
+**/
+void DkPageSegmentation::setRects(const std::vector<DkPolyRect>& rects) {
+	this->rects = rects;
+	candidates = rects;
+}
+
+DkPageSegmentationConfig DkPageSegmentation::getConfig() const {
+	return config;
+}
+
+/**
+* Indicates that the source image is grayscale (e.g. Grayscale8 or a gray Indexed8 image).
+* Such images are often expanded to RGB(A) - only one plane is swept then.
+**/
+void DkPageSegmentation::setGrayscaleSource(bool grayscale) {
+	grayscaleSource = grayscale;
+}
+
+/**
+* If true, the threshold and the Bhaskar detector run concurrently and their candidates are fused.
+* The alternativeMethod flag is ignored then.
+**/
+void DkPageSegmentation::setEnsemble(bool ensemble) {
+	this->ensemble = ensemble;
+}
+
+/**
+* Sets the page found in the previous image of a sequence.
+* It needs to be in the coordinates of this image. If tracking is enabled,
+* compute() searches the page close to its prior first.
+* @param contrasts the edge contrasts of the prior's sides in the previous image (see edgeContrasts()).
+**/
+void DkPageSegmentation::setPrior(const DkPolyRect& prior, const std::vector<float>& contrasts) {
+	this->prior = prior;
+	this->priorContrasts = contrasts;
+}
+
+/**
+* Sets the background of a fixed setup.
+* If it is trained, compute() segments the page against the background
+* and falls back to the detection only if no page is found.
+**/
+void DkPageSegmentation::setBackground(const DkBackgroundModel& background) {
+	this->background = background;
+}
+
+/**
+* Restricts the detection to a region (e.g. the XMP crop rect of a previous run or the scanner bed).
+* Only its bounding box (plus searchTolerance) is segmented and pages that are not
+* within the region - or not aligned with it (angleTolerance) - are rejected.
+* @param region in full resolution coordinates.
+**/
+void DkPageSegmentation::setSearchRegion(const DkPolyRect& region) {
+	searchRegion = region;
+}
+
 DkPolyRect DkPageSegmentation::getMaxRect() const {
 
 	// find the largest rectangle
@@ -60,7 +329,7 @@ DkPolyRect DkPageSegmentation::getMaxRect() const {
 
 		if (ca > maxArea) {
 			maxArea = ca;
-			largeRect = p.toCvPoints();
+			largeRect = p;
 		}
 	}
 
@@ -77,169 +346,821 @@ QImage DkPageSegmentation::getCropped(const QImage & img) const {
 	return img;	// no document page found
 }
 
+/**
+* Crops the image to rect (e.g. a page returned by getPages()).
+**/
+QImage DkPageSegmentation::getCropped(const QImage& img, const DkPolyRect& rect) const {
+
+	if (rect.empty())
+		return img;
+
+	return cropToRect(img, rect.toRotatingRect());
+}
+
+/**
+* Returns all pages that do not overlap ranked by their confidence (see computeConfidence()).
+* Pages with the same confidence are ranked by their area. A rect is dropped if it overlaps
+* with a page ranked higher. Hence, a spread found as one rect hides its pages if it is more confident.
+* Call this after filterDuplicates().
+* @param maxPages the maximal number of pages (0: all).
+* @param overlap rects overlap if their intersection covers more than this fraction of either rect.
+* @return the pages - the most confident first.
+**/
+std::vector<DkPolyRect> DkPageSegmentation::getPages(int maxPages, float overlap) const {
+
+	std::vector<DkPolyRect> ranked = rects;
+	std::stable_sort(ranked.begin(), ranked.end(), [](const DkPolyRect& l, const DkPolyRect& r) {
+
+		if (l.getConfidence().score != r.getConfidence().score)
+			return l.getConfidence().score > r.getConfidence().score;
+
+		return l.getAreaConst() > r.getAreaConst();
+	});
+
+	std::vector<DkPolyRect> pages;
+	std::vector<double> inter;
+
+	for (const DkPolyRect& r : ranked) {
+
+		if (maxPages > 0 && (int)pages.size() >= maxPages)
+			break;
+
+		r.intersectAreas(pages, inter);
+
+		bool overlaps = false;
+		for (size_t idx = 0; idx < pages.size() && !overlaps; idx++)
+			overlaps = std::max(inter[idx]/r.getAreaConst(), inter[idx]/pages[idx].getAreaConst()) > overlap;
+
+		if (!overlaps)
+			pages.push_back(r);
+	}
+
+	return pages;
+}
+
 void DkPageSegmentation::compute() {
 
+	stats.clear();
+
 	cv::Mat lImg;
-	if (alternativeMethod) {
-		if (scale == 1.0f && img.rows > 700.0f)
-			scale = 700.0f / img.rows;
+	if (config.tracking && track()) {
+		qDebug() << "[DkPageSegmentation] page tracked";
+	}
+	else if (findRectanglesBackground()) {
+		qDebug() << "[DkPageSegmentation] page found using the background model";
+	}
+	else {
+		// only the search region is segmented - img is the region's sub-image meanwhile
+		cv::Mat fullImg = img;
+		cv::Rect roi = searchRoi();
+		img = fullImg(roi);
+
+		if (config.cascade && !ensemble && !alternativeMethod) {
+			computeCascade();
+		}
+		else if (ensemble) {
+			if (scale == 1.0f && (float)config.workingWidth/img.cols < 0.8f)
+				scale = (float)config.workingWidth/img.cols;
+
+			lImg = findRectanglesEnsemble(img, rects);
+		}
+		else if (alternativeMethod) {
+			if (scale == 1.0f && img.rows > config.workingHeight)
+				scale = (float)config.workingHeight / img.rows;
 			
-		lImg = findRectanglesAlternative(img, rects);
-	} else {
-		cv::Mat imgLab;
+			lImg = findRectanglesAlternative(img, rects);
+		} else {
 		
-		if (scale == 1.0f && 960.0f/img.cols < 0.8f)
-			scale = 960.0f/img.cols;
+			if (scale == 1.0f && (float)config.workingWidth/img.cols < 0.8f)
+				scale = (float)config.workingWidth/img.cols;
 			
-		cv::cvtColor(img, imgLab, CV_RGB2Lab);	// boost colors
-		lImg = findRectangles(img, rects);
+			lImg = findRectangles(img, rects);
+		}
+
+		img = fullImg;
+
+		if (roi.x != 0 || roi.y != 0) {
+			for (DkPolyRect& r : rects)
+				r.translate(nmc::DkVector((float)roi.x, (float)roi.y));
+		}
+
+		filterSearchRegion(rects);
 	}
 
+	candidates = rects;
+
 	qDebug() << "[DkPageSegmentation] " << rects.size() << " rectangles circles found resize factor: " << scale;
 }
 
 cv::Mat DkPageSegmentation::findRectangles(const cv::Mat& img, std::vector<DkPolyRect>& rects) const {
 	
-	cv::Mat tImg, gray;
+	return findRectanglesScaled(workingImage(img), rects);
+}
 
+/**
+* Returns img downscaled by scale (or img if scale is 1).
+* The working image is resized into the thread context's buffer.
+* Never resize into a buffer that is shared with the input image -
+* img might wrap the caller's QImage (see the QImage constructor).
+**/
+cv::Mat DkPageSegmentation::workingImage(const cv::Mat& img) const {
 
-	if (scale != 1.0f)
-		cv::resize(img, tImg, cv::Size(), scale, scale, CV_INTER_AREA);	// inter nn -> assuming resize to be 1/(2^n)
-	else
-		tImg = img;
+	if (scale == 1.0f)
+		return img;
 
-	std::vector<std::vector<cv::Point> > contours;
+	DkSegmentationContext& ctx = DkSegmentationContext::threadContext();
+	DkStageTimer st(&stats, DkSegmentationStats::stage_resize);
 
-	cv::Mat gray0(tImg.size(), CV_8UC1);
-	cv::Mat lImg(tImg.size(), CV_8UC1);
+	if (ctx.tImg.data == img.data)
+		ctx.tImg.release();	// img keeps its buffer, the working image gets a new one
 
-	// find squares in every color plane of the image
-	for( int c = 0; c < 3; c++ ) {
+	cv::resize(img, ctx.tImg, cv::Size(), scale, scale, CV_INTER_AREA);	// inter nn -> assuming resize to be 1/(2^n)
 
-		int ch[] = {c, 0};
-		mixChannels(&tImg, 1, &gray0, 1, ch, 1);
-		cv::normalize(gray0, gray0, 255, 0, cv::NORM_MINMAX);
+	return ctx.tImg;
+}
 
-		if (c == 0)	// back-up the luminance channel - we use it as precomputed image for the circle detection
-			lImg = gray0.clone();
+/**
+* Finds rectangles in the working image.
+* @param tImg the image downscaled by scale.
+* @param rects the rectangles found (in original image coordinates).
+* @return the first normalized plane (the luminance if a single channel is swept).
+**/
+cv::Mat DkPageSegmentation::findRectanglesScaled(const cv::Mat& tImg, std::vector<DkPolyRect>& rects) const {
+
+	DkSegmentationContext& ctx = DkSegmentationContext::threadContext();
+	DkStageTimer channelTimer(&stats, DkSegmentationStats::stage_channels);
+
+	// extract the color planes (the alpha channel is never swept)
+	// if a single channel is swept, it is the luminance - the first plane of BGR(A) images is blue
+	std::vector<cv::Mat>& cPlanes = ctx.planes;
+	bool luminance = config.maxChannels == 1 && !grayscaleSource && tImg.channels() >= 3;
+	cPlanes.resize(luminance ? 1 : std::min(tImg.channels(), 3));
+
+	if (luminance) {
+		cv::cvtColor(tImg, cPlanes[0], tImg.channels() == 4 ? CV_BGRA2GRAY : CV_BGR2GRAY);
+	}
+	else {
+		cv::parallel_for_(cv::Range(0, (int)cPlanes.size()), [&](const cv::Range& r) {
 
-		int nT = numThresh;//(c == 0) ? numThresh*2 : numThresh;	// more luminance thresholds
+			for (int c = r.start; c < r.end; c++) {
 
-							// try several threshold levels
-		for( int l = 0; l < nT; l++ ) {
+				int ch[] = {c, 0};
+				cPlanes[c].create(tImg.size(), CV_8UC1);
+				mixChannels(&tImg, 1, &cPlanes[c], 1, ch, 1);
+			}
+		});
+	}
 
-			// hack: use Canny instead of zero threshold level.
-			// Canny helps to catch squares with gradient shading
-			if( l == 0 ) {
+	// skip channels that cannot contribute (e.g. grayscale images expanded to RGB)
+	std::vector<cv::Mat> planes;
+	for (int c : planChannels(cPlanes))
+		planes.push_back(cPlanes[c]);
 
-				Canny(gray0, gray, thresh, thresh*3, 5);
-				// dilate canny output to remove potential
-				// holes between edge segments
-				dilate(gray, gray, cv::Mat(), cv::Point(-1,-1));
+	const int numChannels = (int)planes.size();
 
-				//DkIP::imwrite("edgeImg.png", gray);
-			}
-			else {
-				gray = gray0 >= (l+1)*255/numThresh;
-			}
+	cv::parallel_for_(cv::Range(0, numChannels), [&](const cv::Range& r) {
 
-			// find contours and store them all as a list
-			findContours(gray, contours, CV_RETR_LIST, CV_CHAIN_APPROX_SIMPLE);
+		for (int c = r.start; c < r.end; c++)
+			cv::normalize(planes[c], planes[c], 255, 0, cv::NORM_MINMAX);
+	});
 
-			if (looseDetection) {
-				std::vector<std::vector<cv::Point> > hull;
-				for (int i = 0; i < (int)contours.size(); i++) { 
+	channelTimer.stop();
 
-					double cArea = contourArea(cv::Mat(contours[i]));
+	// back-up the first plane - we use it as precomputed image for the circle detection
+	// note: it shares the context's buffer and is overwritten by the next image of this thread
+	cv::Mat lImg = planes[0];
 
-					if (fabs(cArea) > minArea*scale*scale && (!maxArea || fabs(cArea) < maxArea*(scale*scale))) {
-						std::vector<cv::Point> cHull;
-						cv::convexHull(cv::Mat(contours[i]), cHull, false);
-						hull.push_back(cHull);
-					}
-				}
+	// find squares in every color plane and threshold level
+	// each task writes to its own slot - merging them in order keeps the serial order of rects
+	std::vector<std::vector<DkPolyRect> > levelRects(numChannels*config.numThresh);
+
+	if (config.anytime) {
+		findRectanglesAnytime(planes, levelRects);
+	}
+	else {
+		cv::parallel_for_(cv::Range(0, (int)levelRects.size()), [&](const cv::Range& r) {
+
+			for (int idx = r.start; idx < r.end; idx++)
+				findRectanglesLevel(planes[idx/config.numThresh], idx%config.numThresh, levelRects[idx]);
+		});
+	}
+
+	for (size_t idx = 0; idx < levelRects.size(); idx++) {
+
+		for (DkPolyRect& r : levelRects[idx])
+			r.setOrigin((int)idx/config.numThresh, (int)idx%config.numThresh);
+
+		rects.insert(rects.end(), levelRects[idx].begin(), levelRects[idx].end());
+	}
+
+	// note: rects caused by the image border are rejected by filterContours
+	for (size_t idx = 0; idx < rects.size(); idx++)
+		rects[idx].scale(1.0f/scale);
+
+	stats.add(DkSegmentationStats::count_candidates, rects.size());
+
+	return lImg;
+}
+
+/**
+* Selects the color planes that are swept.
+* Grayscale sources (or RGB images with identical planes) are swept in the first
+* plane only. Planes without contrast are skipped since normalizing them amplifies noise.
+* @param planes the (not normalized) color planes of the working image.
+* @return the indexes of the planes to be swept.
+**/
+std::vector<int> DkPageSegmentation::planChannels(const std::vector<cv::Mat>& planes) const {
+
+	const double maxPlaneDiff = 2;	// tolerates compression artifacts
+	const double minContrast = 8;
+
+	if (planes.size() <= 1 || grayscaleSource || config.maxChannels == 1)
+		return std::vector<int>(1, 0);
 
-				contours = hull;
+	bool identical = true;
+	for (size_t c = 1; c < planes.size() && identical; c++)
+		identical = cv::norm(planes[0], planes[c], cv::NORM_INF) <= maxPlaneDiff;
+
+	if (identical) {
+		qDebug() << "[DkPageSegmentation] identical color planes - sweeping the first plane only";
+		return std::vector<int>(1, 0);
+	}
+
+	std::vector<int> channels;
+	for (int c = 0; c < (int)planes.size(); c++) {
+
+		double minV = 0, maxV = 0;
+		cv::minMaxLoc(planes[c], &minV, &maxV);
+
+		if (maxV-minV >= minContrast)
+			channels.push_back(c);
+	}
+
+	if (channels.empty())
+		channels.push_back(0);
+
+	if (config.maxChannels > 0 && (int)channels.size() > config.maxChannels)
+		channels.resize(config.maxChannels);
+
+	return channels;
+}
+
+/**
+* Finds rectangles in a single threshold level of a normalized color plane.
+* This function is called concurrently for all planes and levels and must therefore not modify any members.
+* @param gray0 the normalized color plane (CV_8UC1).
+* @param level the threshold level (level 0 uses Canny instead of a threshold).
+* @param rects the rectangles found are appended to this vector.
+**/
+void DkPageSegmentation::findRectanglesLevel(const cv::Mat& gray0, int level, std::vector<DkPolyRect>& rects) const {
+
+	// levels are processed concurrently - each thread has its own buffers
+	DkSegmentationContext& ctx = DkSegmentationContext::threadContext();
+	cv::Mat& gray = ctx.gray;
+	int64 startTick = cv::getTickCount();
+
+	// hack: use Canny instead of zero threshold level.
+	// Canny helps to catch squares with gradient shading
+	if (level == 0) {
+
+		DkStageTimer st(&stats, DkSegmentationStats::stage_canny);
+
+		Canny(gray0, gray, config.thresh, config.thresh*3, 5);
+		// dilate canny output to remove potential
+		// holes between edge segments
+		dilate(gray, gray, cv::Mat(), cv::Point(-1,-1));
+
+		//DkIP::imwrite("edgeImg.png", gray);
+	}
+	else {
+		DkStageTimer st(&stats, DkSegmentationStats::stage_threshold);
+		cv::compare(gray0, (level+1)*255/config.numThresh, gray, cv::CMP_GE);
+	}
+
+	// find contours and store them all as a list
+	{
+		DkStageTimer st(&stats, DkSegmentationStats::stage_contours);
+		findContours(gray, ctx.contours, CV_RETR_LIST, CV_CHAIN_APPROX_SIMPLE);
+	}
+
+	filterContours(ctx.contours, gray.size(), rects);
+
+	stats.add(DkSegmentationStats::count_levels);
+	stats.addLevelTicks(level, cv::getTickCount()-startTick);
+}
+
+/**
+* Finds rectangles in the levels of all planes until a confident page is found or the time budget is exceeded.
+* The levels are visited in the order of anytimeOrder(). As many levels as we have threads
+* are processed concurrently, so a wave takes about as long as a single level.
+* @param planes the normalized color planes.
+* @param levelRects the rectangles of each (plane, level) slot - skipped slots remain empty.
+**/
+void DkPageSegmentation::findRectanglesAnytime(const std::vector<cv::Mat>& planes, std::vector<std::vector<DkPolyRect> >& levelRects) const {
+
+	std::vector<int> order = anytimeOrder((int)planes.size());
+	int waveSize = std::max(cv::getNumThreads(), 1);
+	int64 startTick = cv::getTickCount();
+
+	for (int wIdx = 0; wIdx < (int)order.size(); wIdx += waveSize) {
+
+		int wEnd = std::min(wIdx+waveSize, (int)order.size());
+
+		cv::parallel_for_(cv::Range(wIdx, wEnd), [&](const cv::Range& r) {
+
+			for (int idx = r.start; idx < r.end; idx++) {
+				int tIdx = order[idx];
+				findRectanglesLevel(planes[tIdx/config.numThresh], tIdx%config.numThresh, levelRects[tIdx]);
 			}
+		});
+
+		if (isConfident(levelRects, planes[0].size())) {
+			qDebug() << "[DkPageSegmentation] confident page found after" << wEnd << "of" << order.size() << "levels";
+			break;
+		}
+
+		double elapsed = (cv::getTickCount()-startTick)/cv::getTickFrequency()*1000.0;
+		if (config.timeBudget > 0 && elapsed > config.timeBudget) {
+			qDebug() << "[DkPageSegmentation] time budget exceeded after" << wEnd << "of" << order.size() << "levels";
+			break;
+		}
+	}
+}
+
+/**
+* Returns the (plane, level) slots in the order they are visited in anytime mode.
+* Most pages are found by Canny or a medium threshold on a single plane. Hence,
+* we start with Canny on the first swept plane (blue for color images, not the luminance),
+* then its thresholds from the middle outwards.
+* The other planes follow in the same manner.
+* @param numChannels the number of planes.
+* @return slot indexes (plane*numThresh + level).
+**/
+std::vector<int> DkPageSegmentation::anytimeOrder(int numChannels) const {
+
+	std::vector<int> levels;
+	levels.push_back(0);	// Canny
+
+	int mid = config.numThresh/2;
+	for (int d = 0; d < config.numThresh; d++) {
+
+		if (mid-d >= 1)
+			levels.push_back(mid-d);
+		if (d > 0 && mid+d < config.numThresh)
+			levels.push_back(mid+d);
+	}
+
+	std::vector<int> order;
+	for (int c = 0; c < numChannels; c++) {
+		for (int l : levels)
+			order.push_back(c*config.numThresh + l);
+	}
+
+	return order;
+}
+
+/**
+* Returns true if a confident page was found.
+* A page is confident if its angles are close to 90 degree (confidentCosine), its area is plausible
+* and an (almost) identical rectangle was found in another level.
+* @param levelRects the rectangles of each (plane, level) slot in working resolution.
+* @param size the working image size.
+**/
+bool DkPageSegmentation::isConfident(const std::vector<std::vector<DkPolyRect> >& levelRects, const cv::Size& size) const {
 
-			std::vector<cv::Point> approx;
-
-			// DEBUG ------------------------
-			//cv::Mat pImg = image.clone();
-			//cv::cvtColor(pImg, pImg, CV_Lab2RGB);
-			// DEBUG ------------------------
-
-			// test each contour
-			for( size_t i = 0; i < contours.size(); i++ ) {
-				// approxicv::Mate contour with accuracy proportional
-				// to the contour perimeter
-				approxPolyDP(cv::Mat(contours[i]), approx, arcLength(cv::Mat(contours[i]), true)*0.02, true);
-
-				double cArea = contourArea(cv::Mat(approx));
-
-				// DEBUG ------------------------
-				//if (fabs(cArea) < maxArea)
-				//	fillConvexPoly(pImg, &approx[0], (int)approx.size(), DkUtils::blue);
-				// DEBUG ------------------------
-
-				// square contours should have 4 vertices after approxicv::Mation
-				// relatively large area (to filter out noisy contours)
-				// and be convex.
-				// Note: absolute value of an area is used because
-				// area may be positive or negative - in accordance with the
-				// contour orientation
-				if( approx.size() == 4 &&
-					fabs(cArea) > minArea*scale*scale &&
-					(!maxArea || fabs(cArea) < maxArea*scale*scale) && 
-					isContourConvex(cv::Mat(approx)) ) {
-
-					DkPolyRect cr(approx);
-					//moutc << minArea*scale*scale << " < " << fabs(cArea) << " < " << maxArea*scale*scale << dkendl;
-
-					// if cosines of all angles are small
-					// (all angles are ~90 degree)
-					if(/*cr.maxSide() < std::max(tImg.rows, tImg.cols)*maxSideFactor && */
-						(!maxSide || cr.maxSide() < maxSide*scale) && 
-						cr.getMaxCosine() < 0.3 ) {
-						rects.push_back(cr);
-					}
+	const double imgArea = (double)size.width*size.height;
+	const double minAreaRatio = 0.1;
+	const double minIoU = 0.9;
+	std::vector<double> inter;
+
+	for (size_t sIdx = 0; sIdx < levelRects.size(); sIdx++) {
+
+		for (const DkPolyRect& r : levelRects[sIdx]) {
+
+			if (r.getMaxCosine() > config.confidentCosine)
+				continue;
+
+			// too small or found because of the image border?
+			DkBox b = r.getBBox();
+			double ra = r.getAreaConst();
+			if (ra < imgArea*minAreaRatio || 
+				b.size().height >= size.height*config.maxSideFactor || 
+				b.size().width >= size.width*config.maxSideFactor)
+				continue;
+
+			// another level has to agree
+			for (size_t oIdx = 0; oIdx < levelRects.size(); oIdx++) {
+
+				if (oIdx == sIdx)
+					continue;
+
+				const std::vector<DkPolyRect>& oRects = levelRects[oIdx];
+				r.intersectAreas(oRects, inter);
+
+				for (size_t idx = 0; idx < oRects.size(); idx++) {
+
+					double uni = ra + oRects[idx].getAreaConst() - inter[idx];
+
+					if (uni > 0 && inter[idx]/uni > minIoU)
+						return true;
 				}
 			}
-			// DEBUG ------------------------
-			//cv::cvtColor(pImg, pImg, CV_RGB2BGR);
-			//DkIP::imwrite("polyImg" + DkUtils::stringify(c) + "-" + DkUtils::stringify(l) + ".png", pImg);
-			// DEBUG ------------------------
 		}
 	}
 
-	for (size_t idx = 0; idx < rects.size(); idx++)
-		rects[idx].scale(1.0f/scale);
+	return false;
+}
 
+/**
+* Approximates contours with polygons and keeps convex quadrilaterals with nearly right angles.
+* The tests are ordered by their costs - most contours (e.g. of text) are rejected before
+* they are approximated: number of points and bbox area (an upper bound of the area).
+* Then the polygon approximation (4 corners), area, convexity, image border and angles are tested.
+* The border test needs the approximated polygon: spurs of the contour are removed by the approximation.
+* @param contours the contours (their convex hull is used if looseDetection is set).
+* @param size the size of the working image.
+* @param rects accepted rectangles are appended.
+**/
+void DkPageSegmentation::filterContours(const std::vector<std::vector<cv::Point> >& contours, const cv::Size& size, std::vector<DkPolyRect>& rects) const {
+
+	DkSegmentationContext& ctx = DkSegmentationContext::threadContext();
+	DkStageTimer st(&stats, DkSegmentationStats::stage_approx);
+
+	const double minArea = config.minArea*scale*scale;
+	const double maxArea = config.maxArea*scale*scale;
+	const float maxWidth = size.width*config.maxSideFactor;
+	const float maxHeight = size.height*config.maxSideFactor;
+
+	// rejections per test - they are added to the stats once
+	int64 numPoints = 0, numBBox = 0, numBorder = 0, numVertices = 0, numArea = 0, numConvex = 0, numShape = 0;
+
+	std::vector<cv::Point>& hull = ctx.hull;
+	std::vector<cv::Point>& approx = ctx.approx;
+
+	for (const std::vector<cv::Point>& contour : contours) {
+
+		// a quadrilateral has at least 4 points
+		if (contour.size() < 4) {
+			numPoints++;
+			continue;
+		}
 
-	// filter rectangles which are found because of the image border
-	std::vector<DkPolyRect> noLargeRects;
-	for (const DkPolyRect& p : rects) {
+		// the bbox's area is an upper bound of the contour's area
+		cv::Rect bb = cv::boundingRect(contour);
+		if (bb.area() <= minArea) {
+			numBBox++;
+			continue;
+		}
 
-		DkBox b = p.getBBox();
+		const std::vector<cv::Point>* poly = &contour;
 
-		if (b.size().height < img.rows*maxSideFactor &&
-			b.size().width < img.cols*maxSideFactor) {
-			noLargeRects.push_back(p);
+		if (config.looseDetection) {
+
+			double cArea = fabs(contourArea(contour));
+			if (cArea <= minArea || (config.maxArea && cArea >= maxArea)) {
+				numArea++;
+				continue;
+			}
+
+			cv::convexHull(contour, hull, false);
+			poly = &hull;
 		}
-	}
 
-	rects = noLargeRects;
+		// approximate contour with accuracy proportional
+		// to the contour perimeter
+		approxPolyDP(*poly, approx, arcLength(*poly, true)*0.02, true);
 
-	return lImg;
+		// square contours should have 4 vertices after approximation
+		if (approx.size() != 4) {
+			numVertices++;
+			continue;
+		}
+
+		// relatively large area (to filter out noisy contours)
+		// Note: absolute value of an area is used because
+		// area may be positive or negative - in accordance with the
+		// contour orientation
+		double cArea = fabs(contourArea(approx));
+		if (cArea <= minArea || (config.maxArea && cArea >= maxArea)) {
+			numArea++;
+			continue;
+		}
+
+		if (!isContourConvex(approx)) {
+			numConvex++;
+			continue;
+		}
+
+		DkPolyRect cr(approx);
+
+		// filter rectangles which are found because of the image border
+		DkBox b = cr.getBBox();
+		if (b.size().width >= maxWidth || b.size().height >= maxHeight) {
+			numBorder++;
+			continue;
+		}
+
+		// if cosines of all angles are small
+		// (all angles are ~90 degree)
+		if ((config.maxSide && cr.maxSide() >= config.maxSide*scale) || cr.getMaxCosine() >= 0.3) {
+			numShape++;
+			continue;
+		}
+
+		rects.push_back(cr);
+	}
+
+	stats.add(DkSegmentationStats::count_contours, contours.size());
+	stats.add(DkSegmentationStats::count_reject_points, numPoints);
+	stats.add(DkSegmentationStats::count_reject_bbox, numBBox);
+	stats.add(DkSegmentationStats::count_reject_border, numBorder);
+	stats.add(DkSegmentationStats::count_reject_vertices, numVertices);
+	stats.add(DkSegmentationStats::count_reject_area, numArea);
+	stats.add(DkSegmentationStats::count_reject_convex, numConvex);
+	stats.add(DkSegmentationStats::count_reject_shape, numShape);
 }
 
 cv::Mat DkPageSegmentation::findRectanglesAlternative(const cv::Mat& img, std::vector<DkPolyRect>& rects) const {
 	PageExtractor extractor;
-	extractor.findPage(img, scale, rects);
+	extractor.findPage(img, scale, rects, &stats);
 
 	return img;
 }
 
+/**
+* Returns the pool of the ensemble's Bhaskar detector.
+* The batch (and the benchmark) fill the global pool. A task queued there is not started
+* but taken back by waitForFinished() and run on the calling thread - after the threshold detector.
+**/
+static QThreadPool& ensemblePool() {
+
+	static QThreadPool pool;
+	return pool;
+}
+
+/**
+* Runs the threshold and the Bhaskar detector concurrently.
+* The image is downscaled once and both detectors work on the same working image.
+* The Bhaskar detector runs in its own pool while the threshold detector keeps OpenCV's 
+* threads. Hence, the runtime is close to that of the slower detector unless all cores are busy.
+**/
+cv::Mat DkPageSegmentation::findRectanglesEnsemble(const cv::Mat& img, std::vector<DkPolyRect>& rects) const {
+
+	cv::Mat tImg = workingImage(img);
+
+	// the Bhaskar detector only reads the working image
+	std::vector<DkPolyRect> altRects;
+	QFuture<void> altFuture = QtConcurrent::run(&ensemblePool(), [&]() {
+
+		PageExtractor extractor;
+		extractor.findPage(tImg, 1.0f, altRects, &stats);
+	});
+
+	cv::Mat lImg = findRectanglesScaled(tImg, rects);
+	altFuture.waitForFinished();
+
+	for (DkPolyRect& r : altRects)
+		r.scale(1.0f/scale);
+
+	fuseCandidates(rects, altRects);
+
+	return lImg;
+}
+
+/**
+* Tracks the prior page (e.g. of the previous frame).
+* Its sides are searched within a narrow band on the full resolution image. The page
+* is accepted if every side is a straight edge: it is found in most samples (trackingSupport),
+* has a single polarity, is close to the fitted line and its contrast is comparable to 
+* the prior's. Edges of text, paper texture or noise close to a moved page fail these tests.
+* @return true if the page was tracked - false if it needs to be detected.
+**/
+bool DkPageSegmentation::track() {
+
+	const double minPolarity = 0.9;
+	const float maxResidual = 1.0f;		// [px]
+	const float maxContrastRatio = 2.0f;
+
+	if (prior.empty() || img.empty())
+		return false;
+
+	DkStageTimer st(&stats, DkSegmentationStats::stage_tracking);
+
+	// the prior is in full resolution coordinates
+	scale = 1.0f;
+
+	float band = std::max(config.trackingBand * std::max(img.rows, img.cols), 2.0f);
+	std::vector<DkEdgeFit> fits;
+	DkPolyRect page = refineCorners(prior, band, &fits);
+
+	if (!page.isConvex() || page.getMaxCosine() > 0.3) {
+		qDebug() << "[DkPageSegmentation] page lost - it is not rectangular";
+		return false;
+	}
+
+	for (int idx = 0; idx < (int)fits.size(); idx++) {
+
+		const DkEdgeFit& f = fits[idx];
+		float pc = idx < (int)priorContrasts.size() ? priorContrasts[idx] : 0.0f;
+
+		bool supported = f.support >= config.trackingSupport && f.polarity >= minPolarity && f.residual <= maxResidual;
+
+		if (supported && pc != 0.0f) {
+			supported = f.contrast*pc > 0 && 
+				std::fabs(f.contrast) <= maxContrastRatio*std::fabs(pc) && 
+				std::fabs(pc) <= maxContrastRatio*std::fabs(f.contrast);
+		}
+
+		if (!supported) {
+			qDebug() << "[DkPageSegmentation] page lost - side" << idx << "support:" << f.support << "polarity:" << f.polarity
+				<< "residual:" << f.residual << "contrast:" << f.contrast << "prior contrast:" << pc;
+			return false;
+		}
+	}
+
+	rects.assign(1, page);
+
+	return true;
+}
+
+/**
+* Returns the part of the image that is segmented: the search region's bounding box plus a margin.
+**/
+cv::Rect DkPageSegmentation::searchRoi() const {
+
+	cv::Rect imgRect(0, 0, img.cols, img.rows);
+
+	if (searchRegion.empty())
+		return imgRect;
+
+	DkBox bb = searchRegion.getBBox();
+
+	// at least 3% margin - otherwise the page touches the ROI's border and is rejected (maxSideFactor)
+	float margin = std::max(config.searchTolerance*std::max(img.cols, img.rows), 
+		0.03f*std::max(bb.size().width, bb.size().height));
+
+	cv::Rect roi(cvFloor(bb.uc.x - margin), cvFloor(bb.uc.y - margin), 
+		cvCeil(bb.size().width + 2*margin), cvCeil(bb.size().height + 2*margin));
+	roi &= imgRect;
+
+	return roi.area() > 0 ? roi : imgRect;
+}
+
+/**
+* Removes rects that are inconsistent with the search region.
+* Their corners are outside the region (plus searchTolerance) or 
+* their orientation differs by more than angleTolerance.
+**/
+void DkPageSegmentation::filterSearchRegion(std::vector<DkPolyRect>& rects) const {
+
+	if (searchRegion.empty())
+		return;
+
+	std::vector<cv::Point2f> region;
+	for (const nmc::DkVector& c : searchRegion.getCorners())
+		region.push_back(cv::Point2f(c.x, c.y));
+
+	double margin = config.searchTolerance*std::max(img.cols, img.rows);
+	double regionAngle = searchRegion.orientation();
+	size_t numRects = rects.size();
+
+	rects.erase(std::remove_if(rects.begin(), rects.end(), [&](const DkPolyRect& r) {
+
+		for (const nmc::DkVector& c : r.getCorners()) {
+			if (cv::pointPolygonTest(region, cv::Point2f(c.x, c.y), true) < -margin)
+				return true;
+		}
+
+		if (config.angleTolerance > 0) {
+			double dAngle = std::abs(r.orientation() - regionAngle);
+			return std::min(dAngle, 90.0 - dAngle) > config.angleTolerance;
+		}
+
+		return false;
+	}), rects.end());
+
+	if (rects.size() < numRects)
+		qDebug() << "[DkPageSegmentation]" << numRects - rects.size() << "rects outside the search region removed";
+}
+
+/**
+* Segments the page against the background model.
+* @return true if a page was found.
+**/
+bool DkPageSegmentation::findRectanglesBackground() {
+
+	if (!background.isTrained() || !background.isCompatible(img.size()))
+		return false;
+
+	DkStageTimer st(&stats, DkSegmentationStats::stage_background);
+	DkPolyRect page = background.segment(img, config.minArea);
+
+	if (page.empty() || page.getMaxCosine() > 0.3)
+		return false;
+
+	// the page's corners are as accurate as the background's resolution
+	scale = background.getScale();
+	rects.assign(1, page);
+
+	return true;
+}
+
+/**
+* Fuses the candidates of two detectors.
+* Candidates that are confirmed by the other detector win: if there are any, all
+* unconfirmed candidates are dropped. Otherwise, the candidates of both detectors are kept.
+* The duplicates are removed later by filterDuplicates().
+* @param rects the candidates of the threshold detector - they are replaced by the fused candidates.
+* @param altRects the candidates of the Bhaskar detector.
+* @param overlap two candidates agree if their intersection covers more than this fraction of both.
+**/
+void DkPageSegmentation::fuseCandidates(std::vector<DkPolyRect>& rects, const std::vector<DkPolyRect>& altRects, float overlap) const {
+
+	std::vector<char> confirmed(rects.size(), 0);
+	std::vector<char> altConfirmed(altRects.size(), 0);
+	std::vector<double> inter;
+
+	for (size_t idx = 0; idx < altRects.size(); idx++) {
+
+		const DkPolyRect& aR = altRects[idx];
+		aR.intersectAreas(rects, inter);
+
+		for (size_t oIdx = 0; oIdx < rects.size(); oIdx++) {
+
+			double i = abs(inter[oIdx]);
+
+			if (std::min(i/aR.getAreaConst(), i/rects[oIdx].getAreaConst()) > overlap) {
+				confirmed[oIdx] = 1;
+				altConfirmed[idx] = 1;
+			}
+		}
+	}
+
+	bool agree = std::find(altConfirmed.begin(), altConfirmed.end(), 1) != altConfirmed.end();
+
+	if (agree) {
+		std::vector<char> deleted(confirmed.size());
+		for (size_t idx = 0; idx < confirmed.size(); idx++)
+			deleted[idx] = !confirmed[idx];
+		removeDeleted(rects, deleted);
+	}
+
+	for (size_t idx = 0; idx < altRects.size(); idx++) {
+
+		if (!agree || altConfirmed[idx])
+			rects.push_back(altRects[idx]);
+	}
+
+	qDebug() << "[DkPageSegmentation] ensemble:" << altRects.size() << "Bhaskar candidates, detectors agree:" << agree;
+}
+
+/**
+* Detects pages with increasing costs.
+* A cheap configuration (the luminance plane, at most 4 levels, 480 px working image) is run first.
+* If its page is not confident (see cascadeConfidence), the full sweep is run. If that
+* page is still not confident, the candidates of the Bhaskar method are added.
+**/
+void DkPageSegmentation::computeCascade() {
+
+	const DkPageSegmentationConfig fullConfig = config;
+
+	// stage 1: cheap sweep
+	config.numThresh = std::min(config.numThresh, 4);
+	config.workingWidth = std::min(config.workingWidth, 480);
+	config.maxChannels = 1;
+	config.anytime = false;
+
+	scale = (float)config.workingWidth/img.cols < 0.8f ? (float)config.workingWidth/img.cols : 1.0f;
+	findRectangles(img, rects);
+	config = fullConfig;
+
+	double conf = pageConfidence(rects);
+	qDebug() << "[DkPageSegmentation] cascade stage 1 - confidence:" << conf;
+
+	if (conf >= config.cascadeConfidence)
+		return;
+
+	// stage 2: full sweep
+	rects.clear();
+	scale = (float)config.workingWidth/img.cols < 0.8f ? (float)config.workingWidth/img.cols : 1.0f;
+	findRectangles(img, rects);
+
+	conf = pageConfidence(rects);
+	qDebug() << "[DkPageSegmentation] cascade stage 2 - confidence:" << conf;
+
+	if (conf >= config.cascadeConfidence)
+		return;
+
+	// stage 3: add the Bhaskar candidates
+	std::vector<DkPolyRect> altRects;
+	float altScale = img.rows > config.workingHeight ? (float)config.workingHeight/img.rows : 1.0f;
+
+	PageExtractor extractor;
+	extractor.findPage(img, altScale, altRects, &stats);
+
+	fuseCandidates(rects, altRects);
+}
+
 QImage DkPageSegmentation::cropToRect(const QImage & img, const nmc::DkRotatingRect & rect, const QColor & bgCol) const {
 	
 	QTransform tForm; 
@@ -257,58 +1178,66 @@ QImage DkPageSegmentation::cropToRect(const QImage & img, const nmc::DkRotatingR
 	double angle = nmc::DkMath::normAngleRad(rect.getAngle(), 0, CV_PI*0.5);
 	double minD = qMin(abs(angle), abs(angle-CV_PI*0.5));
 
-	QImage cImg = QImage(qRound(cImgSize.x()), qRound(cImgSize.y()), QImage::Format_ARGB32);
-	cImg.fill(bgCol.rgba());
-
-	// render the image into the new coordinate system
-	QPainter painter(&cImg);
-	painter.setWorldTransform(tForm);
-
 	// for rotated rects we want perfect anti-aliasing
-	if (minD > FLT_EPSILON)
-		painter.setRenderHints(QPainter::SmoothPixmapTransform | QPainter::Antialiasing);
-
-	painter.drawImage(QRect(QPoint(),img.size()), img, QRect(QPoint(), img.size()));
-	painter.end();
-
-	return cImg;
-
-	//QImage dImg = img;
-	//QPainter p1(&dImg);
-	//p1.drawPolygon(rect.getPoly());
+	DkPageCropper cropper(img, bgCol);
+	QImage cImg = cropper.crop(tForm, QSize(qRound(cImgSize.x()), qRound(cImgSize.y())), minD > FLT_EPSILON);
 
-	//return dImg;
+	return cImg.isNull() ? img : cImg;
 }
 
 void DkPageSegmentation::filterDuplicates(float overlap, float areaRatio) {
 
-	filterDuplicates(rects, overlap, areaRatio);
+	DkStageTimer st(&stats, DkSegmentationStats::stage_filter_duplicates);
+
+	if (config.greedyNms)
+		filterDuplicatesNms(rects, overlap);
+	else
+		filterDuplicates(rects, overlap, areaRatio);
+
+	stats.add(DkSegmentationStats::count_kept, rects.size());
 }
 
+/**
+* Removes rectangles that overlap with a rectangle having a better (smaller) cosine.
+* Only rectangles with overlapping bounding boxes can intersect. Hence, the
+* candidates are looked up in a uniform grid rather than testing all pairs.
+* @param rects the rectangles - they are sorted by area (descending) afterwards.
+* @param overlap rectangles are duplicates if their intersection covers more than this fraction of either rectangle.
+* @param areaRatio rectangles whose area ratio is below this value are never duplicates.
+**/
 void DkPageSegmentation::filterDuplicates(std::vector<DkPolyRect>& rects, float overlap, float areaRatio) const {
 
-	std::vector<int> delIdx;
+	if (rects.size() < 2)
+		return;
+
 	std::sort(rects.rbegin(), rects.rend(), &DkPolyRect::compArea);	// rbegin() -> sort descending
 
+	std::vector<char> deleted(rects.size(), 0);
+	std::vector<int> tmpDelIdx;
+	std::vector<int> candidates;
+
+	DkRectGrid grid(rects);
+
 	for (int idx = 0; idx < (int)rects.size(); idx++) {
 
 		// if we already deleted a rectangle, we can safely skip it
-		if (std::find(delIdx.begin(), delIdx.end(), idx) != delIdx.end())
+		if (deleted[idx])
 			continue;
 
-		DkPolyRect& cR = rects[idx];
-		double cA = cR.getArea();
+		const DkPolyRect& cR = rects[idx];
+		double cA = cR.getAreaConst();
 
-		std::vector<int> tmpDelIdx;
+		tmpDelIdx.clear();
+		grid.query(cR.getBBox(), candidates);	// ascending indexes
 
-		for (int oIdx = idx+1; oIdx < (int)rects.size(); oIdx++) {
+		for (int oIdx : candidates) {
 
 			// if we already deleted a rectangle, we can safely skip it
-			if (idx == oIdx || std::find(delIdx.begin(), delIdx.end(), oIdx) != delIdx.end())
+			if (oIdx <= idx || deleted[oIdx])
 				continue;
 
-			DkPolyRect& oR = rects[oIdx];
-			double oA = oR.getArea();
+			const DkPolyRect& oR = rects[oIdx];
+			double oA = oR.getAreaConst();
 
 			// ignore rectangles with totally different area
 			if (oA/cA < areaRatio)	// since we sort, we know that oA is larger
@@ -316,23 +1245,11 @@ void DkPageSegmentation::filterDuplicates(std::vector<DkPolyRect>& rects, float
 
 			double intersection = abs(oR.intersectArea(cR));
 
-			if (std::max(intersection/cR.getArea(), intersection/oR.getArea()) > overlap) {
-
-				double cVal, oVal;
-
-				// if the cosine is more or less the same, take the larger rectangle
-				//if (fabs(cR.getMaxCosine() - oR.getMaxCosine()) < 0.02) {
-				//	cVal = oA;	// inverse since we want to prefer larger areas
-				//	oVal = cA;
-				//}
-				//else {
-				cVal = cR.getMaxCosine();
-				oVal = oR.getMaxCosine();
-				//}
+			if (std::max(intersection/cA, intersection/oA) > overlap) {
 
 				// delete the rect which has an inferior cosine value
-				if (cVal > oVal) {
-					delIdx.push_back(idx);
+				if (cR.getMaxCosine() > oR.getMaxCosine()) {
+					deleted[idx] = 1;
 					tmpDelIdx.clear();
 					break; // we're done if we delete the current rect
 				}
@@ -342,21 +1259,458 @@ void DkPageSegmentation::filterDuplicates(std::vector<DkPolyRect>& rects, float
 			}
 		}
 
-		delIdx.insert(delIdx.end(), tmpDelIdx.begin(), tmpDelIdx.end());
+		for (int dIdx : tmpDelIdx)
+			deleted[dIdx] = 1;
 	}
 
-	if (!delIdx.empty()) {
-		std::vector<DkPolyRect> filtered;
+	removeDeleted(rects, deleted);
+}
+
+/**
+* Greedy non-maximum suppression.
+* Rectangles are visited in the order of their cosine (best first) and kept if they do not
+* overlap with any rectangle kept before. In contrast to filterDuplicates() a suppressed rectangle
+* never suppresses others.
+* @param rects the rectangles - they are sorted by cosine afterwards.
+* @param overlap rectangles are duplicates if their intersection covers more than this fraction of either rectangle.
+**/
+void DkPageSegmentation::filterDuplicatesNms(std::vector<DkPolyRect>& rects, float overlap) const {
+
+	if (rects.size() < 2)
+		return;
+
+	std::stable_sort(rects.begin(), rects.end(), [](const DkPolyRect& l, const DkPolyRect& r) {
+		return l.getMaxCosine() < r.getMaxCosine();
+	});
+
+	std::vector<char> deleted(rects.size(), 0);
+	std::vector<int> candidates;
+
+	DkRectGrid grid(rects);
+
+	for (int idx = 0; idx < (int)rects.size(); idx++) {
+
+		const DkPolyRect& cR = rects[idx];
+		grid.query(cR.getBBox(), candidates);
+
+		// compare with all better rects that were kept
+		for (int oIdx : candidates) {
 
-		for (int idx = 0; idx < (int)rects.size(); idx++) {
+			if (oIdx >= idx)
+				break;
+
+			if (deleted[oIdx])
+				continue;
 
-			if (std::find(delIdx.begin(), delIdx.end(), idx) == delIdx.end())
-				filtered.push_back(rects[idx]);
+			const DkPolyRect& oR = rects[oIdx];
+			double intersection = abs(oR.intersectArea(cR));
+
+			if (std::max(intersection/cR.getAreaConst(), intersection/oR.getAreaConst()) > overlap) {
+				deleted[idx] = 1;
+				break;
+			}
 		}
+	}
+
+	removeDeleted(rects, deleted);
+}
+
+void DkPageSegmentation::removeDeleted(std::vector<DkPolyRect>& rects, const std::vector<char>& deleted) const {
 
-		qDebug() << "[DkPageSegmentation] " << rects.size() - filtered.size() << " rectangles removed, remaining: " << filtered.size();
-		rects = filtered;
+	size_t numRects = rects.size();
+	size_t nIdx = 0;
+
+	for (size_t idx = 0; idx < rects.size(); idx++) {
+
+		if (!deleted[idx])
+			rects[nIdx++] = rects[idx];
 	}
+
+	rects.resize(nIdx);
+
+	if (nIdx != numRects)
+		qDebug() << "[DkPageSegmentation] " << numRects - nIdx << " rectangles removed, remaining: " << nIdx;
+}
+
+/**
+* Refines the corners of all rectangles found on the full resolution image.
+* The rectangles are detected on a downscaled image and their corners are therefore
+* only accurate up to 1/scale pixels. Only narrow bands around the rectangle's sides are
+* read, so the costs do not depend on the image size. Call this after filterDuplicates().
+**/
+void DkPageSegmentation::refineCorners() {
+
+	if (scale >= 1.0f || img.empty())
+		return;
+
+	DkStageTimer st(&stats, DkSegmentationStats::stage_refine);
+
+	cv::parallel_for_(cv::Range(0, (int)rects.size()), [&](const cv::Range& r) {
+
+		for (int idx = r.start; idx < r.end; idx++)
+			rects[idx] = refineCorners(rects[idx]);
+	});
+}
+
+/**
+* Refines the corners of a single rectangle.
+* A sub-pixel line is fitted to the strongest edge along each side.
+* The refined corners are the intersections of adjacent lines.
+* Sides that cannot be fitted keep their coarse location.
+* @param rect a rectangle in full resolution coordinates.
+* @param searchWidth the sides are searched within +/- searchWidth pixels - if 0, it depends on the working scale.
+* @param fits if set, it receives the edge of every side.
+* @return the refined rectangle.
+**/
+DkPolyRect DkPageSegmentation::refineCorners(const DkPolyRect& rect, float searchWidth, std::vector<DkEdgeFit>* fits) const {
+
+	std::vector<nmc::DkVector> pts = rect.getCorners();
+
+	if (fits)
+		fits->assign(pts.size(), DkEdgeFit());
+
+	if (pts.size() != 4)
+		return rect;
+
+	// the coarse corners are accurate up to a few pixels of the downscaled image
+	if (searchWidth <= 0.0f)
+		searchWidth = 2.0f/scale + 2.0f;
+
+	std::vector<cv::Vec4f> lines(pts.size());
+	for (size_t idx = 0; idx < pts.size(); idx++) {
+
+		const nmc::DkVector& p0 = pts[idx];
+		const nmc::DkVector& p1 = pts[(idx+1) % pts.size()];
+
+		if (!fitEdge(p0, p1, searchWidth, lines[idx], fits ? &(*fits)[idx] : 0)) {
+			cv::Vec4f& l = lines[idx];
+			nmc::DkVector d = p1-p0;
+			d.normalize();
+			l = cv::Vec4f(d.x, d.y, p0.x, p0.y);
+		}
+	}
+
+	std::vector<nmc::DkVector> rPts(pts.size());
+	for (size_t idx = 0; idx < pts.size(); idx++) {
+
+		// corner idx is the intersection of side idx-1 and side idx
+		const cv::Vec4f& l0 = lines[(idx+pts.size()-1) % pts.size()];
+		const cv::Vec4f& l1 = lines[idx];
+
+		double det = (double)l0[0]*l1[1] - (double)l0[1]*l1[0];
+
+		// (nearly) parallel sides - keep the corner
+		if (fabs(det) < 1e-6) {
+			rPts[idx] = pts[idx];
+			continue;
+		}
+
+		double t = ((l1[2]-l0[2])*l1[1] - (l1[3]-l0[3])*l1[0]) / det;
+		nmc::DkVector c((float)(l0[2] + t*l0[0]), (float)(l0[3] + t*l0[1]));
+
+		// do not allow the corner to leave the search region
+		if (nmc::DkVector(c-pts[idx]).norm() > searchWidth*2)
+			c = pts[idx];
+
+		rPts[idx] = c;
+	}
+
+	DkPolyRect rRect(rPts);
+	rRect.setOrigin(rect.getChannel(), rect.getLevel());
+
+	return rRect;
+}
+
+/**
+* Fits a line to the strongest edge close to the side p0 -> p1.
+* The gray value profile is sampled along the side's normal and the gradient maximum
+* is interpolated with a parabola which results in sub-pixel edge points.
+* @param p0 first corner of the side.
+* @param p1 second corner of the side.
+* @param searchWidth the edge is searched within +/- searchWidth pixels.
+* @param line the line fitted (vx, vy, x0, y0) - see cv::fitLine.
+* @param fit if set, it receives the edge's support, polarity, contrast and residual.
+* @return true if enough edge points were found.
+**/
+bool DkPageSegmentation::fitEdge(const nmc::DkVector& p0, const nmc::DkVector& p1, float searchWidth, cv::Vec4f& line, DkEdgeFit* fit) const {
+
+	const int numSamples = 32;
+	const float minGradient = 8.0f;
+
+	nmc::DkVector dir = p1-p0;
+	float length = dir.norm();
+
+	if (length < 1.0f)
+		return false;
+
+	dir /= length;
+	nmc::DkVector normal(-dir.y, dir.x);
+
+	int sw = cvCeil(searchWidth);
+	std::vector<float> profile(2*sw+3);
+	std::vector<cv::Point2f> edgePts;
+	std::vector<float> gradients;	// signed
+
+	for (int sIdx = 0; sIdx < numSamples; sIdx++) {
+
+		// skip the corner regions (10% on either side)
+		float pos = length * (0.1f + 0.8f*(sIdx+0.5f)/numSamples);
+		nmc::DkVector sp = p0 + dir*pos;
+
+		for (int t = -sw-1; t <= sw+1; t++) {
+			nmc::DkVector cp = sp + normal*(float)t;
+			profile[t+sw+1] = grayAt(cp.x, cp.y);
+		}
+
+		// find the strongest gradient along the normal
+		int bestT = 0;
+		float bestG = 0;
+		for (int t = -sw; t <= sw; t++) {
+
+			float g = fabs(profile[t+sw+2] - profile[t+sw]);
+			if (g > bestG) {
+				bestG = g;
+				bestT = t;
+			}
+		}
+
+		if (bestG < minGradient || abs(bestT) == sw)
+			continue;
+
+		// parabolic sub-pixel interpolation
+		float gl = fabs(profile[bestT+sw+1] - profile[bestT+sw-1]);
+		float gr = fabs(profile[bestT+sw+3] - profile[bestT+sw+1]);
+		float denom = gl - 2*bestG + gr;
+		float offset = fabs(denom) > FLT_EPSILON ? 0.5f*(gl-gr)/denom : 0.0f;
+
+		nmc::DkVector ep = sp + normal*(bestT + offset);
+		edgePts.push_back(cv::Point2f(ep.x, ep.y));
+		gradients.push_back(profile[bestT+sw+2] - profile[bestT+sw]);
+	}
+
+	if (fit && !gradients.empty()) {
+
+		int numPositive = (int)std::count_if(gradients.begin(), gradients.end(), [](float g) { return g > 0; });
+
+		fit->support = (double)edgePts.size()/numSamples;
+		fit->polarity = (double)std::max(numPositive, (int)gradients.size()-numPositive)/gradients.size();
+
+		std::nth_element(gradients.begin(), gradients.begin() + gradients.size()/2, gradients.end());
+		fit->contrast = gradients[gradients.size()/2];
+	}
+
+	if ((int)edgePts.size() < numSamples/4)
+		return false;
+
+	cv::fitLine(edgePts, line, CV_DIST_HUBER, 0, 0.01, 0.01);
+
+	if (fit) {
+
+		std::vector<float> dists;
+		for (const cv::Point2f& p : edgePts)
+			dists.push_back(std::fabs((p.x-line[2])*line[1] - (p.y-line[3])*line[0]));
+
+		std::nth_element(dists.begin(), dists.begin() + dists.size()/2, dists.end());
+		fit->residual = dists[dists.size()/2];
+	}
+
+	return true;
+}
+
+/**
+* Returns the edge contrast of every side of rect (0 if a side has no edge).
+* The next image of a sequence compares the edges of the tracked page with these (see setPrior()).
+* @param rect a page in full resolution coordinates.
+**/
+std::vector<float> DkPageSegmentation::edgeContrasts(const DkPolyRect& rect) const {
+
+	std::vector<float> contrasts;
+
+	if (img.empty() || rect.size() != 4)
+		return contrasts;
+
+	for (int idx = 0; idx < rect.size(); idx++) {
+
+		DkEdgeFit fit;
+		cv::Vec4f line;
+		bool found = fitEdge(rect.corner(idx), rect.corner((idx+1) % rect.size()), 2.0f/scale + 2.0f, line, &fit);
+
+		contrasts.push_back(found ? fit.contrast : 0.0f);
+	}
+
+	return contrasts;
+}
+
+/**
+* Returns the bilinearly interpolated gray value (mean of the color channels) of the full resolution image.
+* Coordinates outside the image are clamped to the border.
+**/
+float DkPageSegmentation::grayAt(float x, float y) const {
+
+	x = std::min(std::max(x, 0.0f), (float)img.cols-1.001f);
+	y = std::min(std::max(y, 0.0f), (float)img.rows-1.001f);
+
+	int x0 = (int)x;
+	int y0 = (int)y;
+	float fx = x-x0;
+	float fy = y-y0;
+
+	const int cn = img.channels();
+	const int numCh = std::min(cn, 3);
+	const unsigned char* r0 = img.ptr<unsigned char>(y0) + x0*cn;
+	const unsigned char* r1 = img.ptr<unsigned char>(y0+1) + x0*cn;
+
+	float val = 0;
+	for (int c = 0; c < numCh; c++) {
+		val += (1-fy) * ((1-fx)*r0[c] + fx*r0[c+cn]) + 
+			fy * ((1-fx)*r1[c] + fx*r1[c+cn]);
+	}
+
+	return val/numCh;
+}
+
+/**
+* Computes the confidence of all rects (see getConfidence()).
+* Call this after filterDuplicates() and refineCorners().
+**/
+void DkPageSegmentation::computeConfidence() {
+
+	DkStageTimer st(&stats, DkSegmentationStats::stage_confidence);
+
+	cv::parallel_for_(cv::Range(0, (int)rects.size()), [&](const cv::Range& r) {
+
+		for (int idx = r.start; idx < r.end; idx++)
+			rects[idx].setConfidence(confidence(rects[idx], candidates));
+	});
+}
+
+/**
+* Computes the confidence of a rect.
+* Candidates that cover the same region count as agreeing levels. The score
+* is the product of the edge support, the rect's angles, the agreement and its area.
+* @param rect the rect (page).
+* @param candidates all rects found before duplicates were removed.
+**/
+DkPageConfidence DkPageSegmentation::confidence(const DkPolyRect& rect, const std::vector<DkPolyRect>& candidates) const {
+
+	const double minOverlap = 0.9;
+
+	DkPageConfidence c;
+	c.edgeSupport = edgeSupport(rect);
+	c.maxCosine = rect.getMaxCosine();
+	c.areaRatio = img.empty() ? 0.0 : rect.getAreaConst()/((double)img.rows*img.cols);
+
+	std::vector<double> inter;
+	rect.intersectAreas(candidates, inter);
+
+	std::vector<std::pair<int, int> > levels;
+	std::vector<int> channels;
+
+	for (size_t idx = 0; idx < candidates.size(); idx++) {
+
+		const DkPolyRect& cR = candidates[idx];
+
+		if (std::min(inter[idx]/rect.getAreaConst(), inter[idx]/cR.getAreaConst()) > minOverlap) {
+
+			levels.push_back(std::make_pair(cR.getChannel(), cR.getLevel()));
+
+			if (cR.getChannel() >= 0)
+				channels.push_back(cR.getChannel());
+		}
+	}
+
+	std::sort(levels.begin(), levels.end());
+	std::sort(channels.begin(), channels.end());
+	c.numLevels = (int)(std::unique(levels.begin(), levels.end()) - levels.begin());
+	c.numChannels = (int)(std::unique(channels.begin(), channels.end()) - channels.begin());
+
+	// 0.3 is the cosine limit of filterContours & pages covering less than 10% of the image are suspicious
+	double cosScore = 1.0 - std::min(c.maxCosine/0.3, 1.0);
+	double agreeScore = std::min(c.numLevels/3.0, 1.0);
+	double areaScore = std::min(c.areaRatio/0.1, 1.0);
+
+	c.score = c.edgeSupport * cosScore * (0.5 + 0.5*agreeScore) * areaScore;
+
+	return c;
+}
+
+/**
+* Returns the confidence of the page that would be selected from rects.
+* Duplicates are removed from a copy of rects first.
+**/
+double DkPageSegmentation::pageConfidence(const std::vector<DkPolyRect>& rects) const {
+
+	std::vector<DkPolyRect> pages = rects;
+
+	if (config.greedyNms)
+		filterDuplicatesNms(pages, 0.6f);
+	else
+		filterDuplicates(pages, 0.6f, 0.5f);
+
+	if (pages.empty())
+		return 0.0;
+
+	auto page = std::max_element(pages.begin(), pages.end(), &DkPolyRect::compArea);
+
+	return confidence(*page, rects).score;
+}
+
+/**
+* Returns the fraction of the rect's sides that are supported by edges of the full resolution image.
+* The sides are sampled and an edge needs to be within the accuracy of the working image.
+**/
+double DkPageSegmentation::edgeSupport(const DkPolyRect& rect) const {
+
+	const int numSamples = 16;	// per side
+	const float minGradient = 8.0f;
+
+	if (img.empty() || rect.size() < 2)
+		return 0.0;
+
+	int sw = cvCeil(1.0f/scale + 1.0f);
+	std::vector<float> profile(2*sw+3);
+
+	int numSupported = 0;
+	int numTotal = 0;
+
+	for (int idx = 0; idx < rect.size(); idx++) {
+
+		const nmc::DkVector& p0 = rect.corner(idx);
+		const nmc::DkVector& p1 = rect.corner((idx+1) % rect.size());
+
+		nmc::DkVector dir = p1-p0;
+		float length = dir.norm();
+
+		if (length < 1.0f)
+			continue;
+
+		dir /= length;
+		nmc::DkVector normal(-dir.y, dir.x);
+
+		for (int sIdx = 0; sIdx < numSamples; sIdx++) {
+
+			// skip the corner regions (10% on either side)
+			float pos = length * (0.1f + 0.8f*(sIdx+0.5f)/numSamples);
+			nmc::DkVector sp = p0 + dir*pos;
+
+			for (int t = -sw-1; t <= sw+1; t++) {
+				nmc::DkVector cp = sp + normal*(float)t;
+				profile[t+sw+1] = grayAt(cp.x, cp.y);
+			}
+
+			numTotal++;
+
+			for (int t = -sw; t <= sw; t++) {
+
+				if (fabs(profile[t+sw+2] - profile[t+sw]) >= minGradient) {
+					numSupported++;
+					break;
+				}
+			}
+		}
+	}
+
+	return numTotal > 0 ? (double)numSupported/numTotal : 0.0;
 }
 
 void DkPageSegmentation::draw(cv::Mat& img, const cv::Scalar& col) const {
@@ -25,6 +25,7 @@
 #pragma once
 
 #include "DkPageSegmentationUtils.h"
+#include "DkBackgroundModel.h"
 
 #pragma warning(push, 0)	// no warnings from includes - begin
 #include <opencv2/core/core.hpp>
@@ -32,50 +33,181 @@
 
 #include <QColor>
 #include <QImage>
+#include <QSettings>
 #pragma warning(pop)		// no warnings from includes - end
 
 namespace nmp {
 
 class DkRotatingRect;
 
+/**
+* Parameters of the page segmentation.
+* The presets trade speed for accuracy. Single parameters
+* can be overridden in the settings.
+**/
+struct DkPageSegmentationConfig {
+
+	enum Preset {
+		preset_fast = 0,
+		preset_balanced,
+		preset_accurate,
+
+		preset_end
+	};
+
+	DkPageSegmentationConfig(Preset preset = preset_balanced);
+
+	void loadSettings(QSettings& settings);
+	void saveSettings(QSettings& settings) const;
+	QByteArray fingerprint() const;
+
+	static QString presetName(Preset preset);
+	static Preset presetFromName(const QString& name);
+
+	Preset preset = preset_balanced;
+
+	int thresh = 80;				// Canny threshold
+	int numThresh = 10;				// number of levels per channel (level 0 is Canny)
+	double minArea = 12000;			// [px] w.r.t. the full resolution image
+	double maxArea = 0;				// [px] 0 -> unlimited
+	float maxSide = 0;				// [px] 0 -> unlimited
+	float maxSideFactor = 0.97f;	// rects larger than this fraction of the image are border artifacts
+	int workingWidth = 960;			// [px] width of the working image (multiple thresholds)
+	int workingHeight = 700;		// [px] height of the working image (Bhaskar)
+	bool looseDetection = false;	// use the convex hull of contours
+	bool refineCorners = false;		// refine the corners on the full resolution image
+	bool anytime = false;			// visit the levels in a heuristic order and stop as soon as a confident page is found
+	double timeBudget = 0;			// [ms] anytime mode only - 0 means unlimited
+	double confidentCosine = 0.1;	// anytime mode only - maximal cosine of a confident page
+	bool greedyNms = false;			// filter duplicates with greedy non-maximum suppression
+	int maxChannels = 0;			// maximal number of swept color channels - 0 means all, 1 sweeps the luminance
+	bool cascade = false;			// run a cheap configuration first and escalate only if the page is not confident
+	double cascadeConfidence = 0.5;	// cascade mode only - minimal confidence of the page
+	int maxPages = 0;				// maximal number of pages per image (multiple pages) - 0 means all
+	bool tracking = false;			// track the prior page (e.g. of the previous frame) and detect only if it is lost
+	float trackingBand = 0.01f;		// tracking mode only - search band relative to the larger image side
+	double trackingSupport = 0.7;	// tracking mode only - minimal edge support of a tracked page
+	bool backgroundModel = false;	// segment pages against a background learned from the first images (or BackgroundImage)
+	int backgroundSamples = 5;		// background mode only - number of images the background is learned from
+	QString backgroundImage;		// background mode only - image of the empty setup
+	QRectF searchRect;				// search region relative to the image size (e.g. the scanner bed) - empty means the whole image
+	float searchTolerance = 0.02f;	// search region only - margin relative to the larger image side
+	double angleTolerance = 0;		// [deg] search region only - maximal deviation of the page's orientation from the region (0: any orientation)
+};
+
+/**
+* Scratch buffers of the page segmentation.
+* Every thread has its own context that keeps the buffers between images.
+* Hence, batches of same-size images do not reallocate them.
+**/
+class DkSegmentationContext {
+
+public:
+	static DkSegmentationContext& threadContext();
+
+	// per image
+	cv::Mat tImg;
+	std::vector<cv::Mat> planes;
+
+	// per level
+	cv::Mat gray;
+	std::vector<std::vector<cv::Point> > contours;
+	std::vector<cv::Point> hull;
+	std::vector<cv::Point> approx;
+};
+
+/**
+* Edge found along a page side (see DkPageSegmentation::fitEdge).
+**/
+struct DkEdgeFit {
+	double support = 0;		// fraction of the side's samples with an edge
+	double polarity = 0;	// fraction of the edge points with the dominant gradient sign
+	float contrast = 0;		// median gradient along the side's normal (signed)
+	float residual = 0;		// [px] median distance of the edge points to the fitted line
+};
+
 class DkPageSegmentation {
 
 public:
-	DkPageSegmentation(const cv::Mat& colImg = cv::Mat(), bool alternativeMethod = false);
+	DkPageSegmentation(const cv::Mat& colImg = cv::Mat(), bool alternativeMethod = false, const DkPageSegmentationConfig& config = DkPageSegmentationConfig());
+	DkPageSegmentation(const QImage& img, bool alternativeMethod = false, const DkPageSegmentationConfig& config = DkPageSegmentationConfig());
 
 	virtual void compute();
 	virtual void filterDuplicates(float overlap = 0.6f, float areaRatio = 0.5f);
 	virtual void filterDuplicates(std::vector<DkPolyRect>& rects, float overlap = 0.6f, float areaRatio = 0.1f) const;
+	virtual void filterDuplicatesNms(std::vector<DkPolyRect>& rects, float overlap = 0.6f) const;
+	virtual void refineCorners();
+	virtual void computeConfidence();
 
 	virtual std::vector<DkPolyRect> getRects() const { return rects; };
+	const DkSegmentationStats& getStats() const { return stats; };
+	void setRects(const std::vector<DkPolyRect>& rects);
 	virtual cv::Mat getDebugImg() const;
+	cv::Mat getImage() const;
 	virtual QImage getCropped(const QImage& img) const;
+	virtual QImage getCropped(const QImage& img, const DkPolyRect& rect) const;
 	virtual void draw(cv::Mat& img, const cv::Scalar& col = cv::Scalar(255, 222, 0)) const;
 	virtual void draw(QImage& img, const QColor& col = QColor(255, 222, 0)) const;
 	virtual void draw(cv::Mat& img, const std::vector<DkPolyRect>& rects, const cv::Scalar& col = cv::Scalar(255, 222, 0)) const;
 	DkPolyRect getMaxRect() const;
+	std::vector<float> edgeContrasts(const DkPolyRect& rect) const;
+	std::vector<DkPolyRect> getPages(int maxPages = 0, float overlap = 0.1f) const;
 
-	bool looseDetection;
+	void setConfig(const DkPageSegmentationConfig& config);
+	DkPageSegmentationConfig getConfig() const;
+	void setGrayscaleSource(bool grayscale);
+	void setEnsemble(bool ensemble);
+	void setPrior(const DkPolyRect& prior, const std::vector<float>& contrasts = std::vector<float>());
+	void setBackground(const DkBackgroundModel& background);
+	void setSearchRegion(const DkPolyRect& region);
 
 protected:
 	cv::Mat img;
+	QImage qImg;	// keeps the buffer alive if img wraps a QImage
 	cv::Mat dbgImg;
 
-	int thresh = 80;
-	int numThresh = 10;
-	double minArea = 12000;
-	double maxArea = 0;
-	float maxSide = 0;
-	float maxSideFactor = 0.97f;
 	float scale = 1.0f;
 	bool alternativeMethod;
+	DkPageSegmentationConfig config;
+	bool grayscaleSource = false;
+	bool ensemble = false;
 
 	std::vector<DkPolyRect> rects;
+	std::vector<DkPolyRect> candidates;	// rects before duplicates are removed
+	DkPolyRect prior;
+	std::vector<float> priorContrasts;	// edge contrast of every side of the prior
+	DkBackgroundModel background;
+	DkPolyRect searchRegion;
+	mutable DkSegmentationStats stats;	// concurrent stages record their times
 
 	virtual cv::Mat findRectangles(const cv::Mat& img, std::vector<DkPolyRect>& squares) const;
 	virtual cv::Mat findRectanglesAlternative(const cv::Mat& img, std::vector<DkPolyRect>& squares) const;
+	virtual cv::Mat findRectanglesEnsemble(const cv::Mat& img, std::vector<DkPolyRect>& squares) const;
+	cv::Mat findRectanglesScaled(const cv::Mat& tImg, std::vector<DkPolyRect>& rects) const;
+	cv::Mat workingImage(const cv::Mat& img) const;
+	void computeCascade();
+	bool track();
+	bool findRectanglesBackground();
+	cv::Rect searchRoi() const;
+	void filterSearchRegion(std::vector<DkPolyRect>& rects) const;
+	void fuseCandidates(std::vector<DkPolyRect>& rects, const std::vector<DkPolyRect>& altRects, float overlap = 0.8f) const;
+	std::vector<int> planChannels(const std::vector<cv::Mat>& planes) const;
+	void findRectanglesLevel(const cv::Mat& gray0, int level, std::vector<DkPolyRect>& rects) const;
+	void filterContours(const std::vector<std::vector<cv::Point> >& contours, const cv::Size& size, std::vector<DkPolyRect>& rects) const;
+	void findRectanglesAnytime(const std::vector<cv::Mat>& planes, std::vector<std::vector<DkPolyRect> >& levelRects) const;
+	std::vector<int> anytimeOrder(int numChannels) const;
+	bool isConfident(const std::vector<std::vector<DkPolyRect> >& levelRects, const cv::Size& size) const;
 	QImage cropToRect(const QImage& img, const nmc::DkRotatingRect& rect, const QColor& bgCol = QColor(0,0,0)) const;
 	void drawRects(QPainter* p, const std::vector<DkPolyRect>& rects, const QColor& col = QColor(100, 100, 100)) const;
+	void removeDeleted(std::vector<DkPolyRect>& rects, const std::vector<char>& deleted) const;
+
+	DkPolyRect refineCorners(const DkPolyRect& rect, float searchWidth = 0.0f, std::vector<DkEdgeFit>* fits = 0) const;
+	bool fitEdge(const nmc::DkVector& p0, const nmc::DkVector& p1, float searchWidth, cv::Vec4f& line, DkEdgeFit* fit = 0) const;
+	float grayAt(float x, float y) const;
+
+	DkPageConfidence confidence(const DkPolyRect& rect, const std::vector<DkPolyRect>& candidates) const;
+	double pageConfidence(const std::vector<DkPolyRect>& rects) const;
+	double edgeSupport(const DkPolyRect& rect) const;
 };
 
 };
@@ -209,41 +209,215 @@ void DkIntersectPoly::computeBoundingBox(std::vector<nmc::DkVector> vec, nmc::Dk
 	}
 };
 
+// DkIntersectConvex --------------------------------------------------------------------
+/**
+* Returns the intersection area of two convex polygons.
+* The polygons may have any orientation.
+* @param a vertices of the first polygon.
+* @param na number of vertices of a (at most max_vertices).
+* @param b vertices of the second polygon.
+* @param nb number of vertices of b (at most max_vertices).
+* @return the (non-negative) intersection area.
+**/
+double DkIntersectConvex::compute(const nmc::DkVector* a, int na, const nmc::DkVector* b, int nb) {
+
+	if (na < 3 || nb < 3 || na > max_vertices || nb > max_vertices)
+		return 0;
+
+	// clipping a convex polygon adds at most one vertex per clip edge
+	const int capacity = 2*max_vertices;
+	Point bufA[capacity];
+	Point bufB[capacity];
+	Point clip[max_vertices];
+
+	for (int idx = 0; idx < nb; idx++)
+		clip[idx] = {b[idx].x, b[idx].y};
+
+	// orientation of the clip polygon
+	double orient = 0;
+	for (int idx = 0; idx < nb; idx++) {
+		const Point& c = clip[idx];
+		const Point& n = clip[(idx+1) % nb];
+		orient += c.x*n.y - n.x*c.y;
+	}
+
+	if (orient == 0)
+		return 0;
+
+	orient = orient > 0 ? 1.0 : -1.0;
+
+	Point* in = bufA;
+	Point* out = bufB;
+	int numIn = na;
+
+	for (int idx = 0; idx < na; idx++)
+		in[idx] = {a[idx].x, a[idx].y};
+
+	for (int eIdx = 0; eIdx < nb && numIn > 0; eIdx++) {
+
+		const Point& p = clip[eIdx];
+		const Point& q = clip[(eIdx+1) % nb];
+		double ex = q.x - p.x;
+		double ey = q.y - p.y;
+		int numOut = 0;
+
+		for (int idx = 0; idx < numIn && numOut < capacity-1; idx++) {
+
+			const Point& c = in[idx];
+			const Point& d = in[(idx+1) % numIn];
+
+			double dc = orient * (ex*(c.y-p.y) - ey*(c.x-p.x));
+			double dd = orient * (ex*(d.y-p.y) - ey*(d.x-p.x));
+
+			if (dc >= 0)
+				out[numOut++] = c;
+
+			// the edge crosses the clip line
+			if ((dc >= 0) != (dd >= 0)) {
+				double t = dc / (dc - dd);
+				out[numOut++] = {c.x + t*(d.x-c.x), c.y + t*(d.y-c.y)};
+			}
+		}
+
+		std::swap(in, out);
+		numIn = numOut;
+	}
+
+	return area(in, numIn);
+}
+
+bool DkIntersectConvex::isConvex(const nmc::DkVector* pts, int n) {
+
+	if (n < 3)
+		return false;
+
+	int sign = 0;
+
+	for (int idx = 0; idx < n; idx++) {
+
+		const nmc::DkVector& p0 = pts[idx];
+		const nmc::DkVector& p1 = pts[(idx+1) % n];
+		const nmc::DkVector& p2 = pts[(idx+2) % n];
+
+		double cross = (double)(p1.x-p0.x)*(p2.y-p1.y) - (double)(p1.y-p0.y)*(p2.x-p1.x);
+
+		if (cross == 0)
+			continue;
+
+		int cs = cross > 0 ? 1 : -1;
+
+		if (sign == 0)
+			sign = cs;
+		else if (sign != cs)
+			return false;
+	}
+
+	return sign != 0;
+}
+
+double DkIntersectConvex::area(const Point* pts, int n) {
+
+	if (n < 3)
+		return 0;
+
+	double a = 0;
+	for (int idx = 0; idx < n; idx++) {
+		const Point& c = pts[idx];
+		const Point& nc = pts[(idx+1) % n];
+		a += c.x*nc.y - nc.x*c.y;
+	}
+
+	return std::abs(a) * 0.5;
+}
+
 // DkPolyRect --------------------------------------------------------------------
 DkPolyRect::DkPolyRect(const std::vector<cv::Point>& pts) {
 
-	toDkVectors(pts, this->pts);
-	computeMaxCosine();
-	area = DBL_MAX;
+	if (pts.size() > max_corners)
+		qWarning() << "[DkPolyRect]" << pts.size() << "corners given, only" << max_corners << "are supported";
+
+	numPts = std::min((int)pts.size(), (int)max_corners);
+	for (int idx = 0; idx < numPts; idx++)
+		this->pts[idx] = nmc::DkVector(pts[idx]);
+
+	updateGeometry();
 }
 
 DkPolyRect::DkPolyRect(const std::vector<nmc::DkVector>& pts) {
-	this->pts = pts;
-	computeMaxCosine();
-	area = DBL_MAX;
+
+	if (pts.size() > max_corners)
+		qWarning() << "[DkPolyRect]" << pts.size() << "corners given, only" << max_corners << "are supported";
+
+	numPts = std::min((int)pts.size(), (int)max_corners);
+	for (int idx = 0; idx < numPts; idx++)
+		this->pts[idx] = pts[idx];
+
+	updateGeometry();
 }
 
 bool DkPolyRect::empty() const {
-	return pts.empty();
+	return numPts == 0;
+}
+
+int DkPolyRect::size() const {
+	return numPts;
+}
+
+const nmc::DkVector& DkPolyRect::corner(int idx) const {
+	return pts[idx];
 }
 
-void DkPolyRect::toDkVectors(const std::vector<cv::Point>& pts, std::vector<nmc::DkVector>& dkPts) const {
+/**
+* Computes area (shoelace), bounding box, max side and max cosine.
+* They are cached since sorting and filtering rects query them repeatedly.
+**/
+void DkPolyRect::updateGeometry() {
+
+	area = 0;
+	maxSideLength = 0;
+	maxCosine = 0;
+	bbUc = nmc::DkVector(FLT_MAX, FLT_MAX);
+	bbLc = nmc::DkVector(-FLT_MAX, -FLT_MAX);
+
+	if (numPts == 0) {
+		bbUc = nmc::DkVector();
+		bbLc = nmc::DkVector();
+		convex = false;
+		return;
+	}
+
+	for (int idx = 0; idx < numPts; idx++) {
+
+		const nmc::DkVector& c = pts[idx];
+		const nmc::DkVector& n = pts[(idx+1) % numPts];
+
+		area += (double)c.x*n.y - (double)n.x*c.y;
+
+		float cs = nmc::DkVector(n - c).norm();
+		if (maxSideLength < cs)
+			maxSideLength = cs;
+
+		bbUc = bbUc.minVec(c);
+		bbLc = bbLc.maxVec(c);
+	}
+
+	area = std::abs(area) * 0.5;
+	convex = DkIntersectConvex::isConvex(pts, numPts);
 
-	for (int idx = 0; idx < (int)pts.size(); idx++)
-		dkPts.push_back(nmc::DkVector(pts.at(idx)));
+	computeMaxCosine();
 }
 
 void DkPolyRect::computeMaxCosine() {
 
 	maxCosine = 0;
 
-	for (int idx = 2; idx < (int)pts.size()+2; idx++ ) {
+	for (int idx = 2; idx < numPts+2; idx++ ) {
 
-		nmc::DkVector& c = pts[(idx-1)%pts.size()];	// current corner;
-		nmc::DkVector& c1 = pts[idx%pts.size()];
-		nmc::DkVector& c2 = pts[idx-2];
+		const nmc::DkVector& c = pts[(idx-1)%numPts];	// current corner;
+		const nmc::DkVector& c1 = pts[idx%numPts];
+		const nmc::DkVector& c2 = pts[idx-2];
 
-		double cosine = abs((c1-c).cosv(c2-c));
+		double cosine = abs(nmc::DkVector(c1-c).cosv(c2-c));
 
 		maxCosine = std::max(maxCosine, cosine);
 	}
@@ -251,36 +425,103 @@ void DkPolyRect::computeMaxCosine() {
 
 double DkPolyRect::intersectArea(const DkPolyRect& pr) const {
 
-	return DkIntersectPoly(pts, pr.pts).compute();
+	if (convex && pr.convex)
+		return DkIntersectConvex::compute(pts, numPts, pr.pts, pr.numPts);
+
+	return DkIntersectPoly(getCorners(), pr.getCorners()).compute();
+}
+
+/**
+* Computes the intersection areas with many rects at once.
+* Rects whose bounding boxes do not overlap are rejected in a
+* first (branch-free) pass so that only candidates are clipped.
+* @param rects the rects to intersect with.
+* @param areas the (absolute) intersection areas - one per rect.
+**/
+void DkPolyRect::intersectAreas(const std::vector<DkPolyRect>& rects, std::vector<double>& areas) const {
+
+	const size_t n = rects.size();
+	areas.assign(n, 0.0);
+
+	std::vector<char> candidates(n);
+	for (size_t idx = 0; idx < n; idx++) {
+		const DkPolyRect& r = rects[idx];
+		candidates[idx] = (char)((r.bbUc.x <= bbLc.x) & (bbUc.x <= r.bbLc.x) &
+			(r.bbUc.y <= bbLc.y) & (bbUc.y <= r.bbLc.y));
+	}
+
+	for (size_t idx = 0; idx < n; idx++) {
+		if (candidates[idx])
+			areas[idx] = std::abs(intersectArea(rects[idx]));
+	}
+}
+
+bool DkPolyRect::isConvex() const {
+	return convex;
 }
 
 void DkPolyRect::scale(float s) {
 
-	for (size_t idx = 0; idx < pts.size(); idx++)
+	for (int idx = 0; idx < numPts; idx++)
 		pts[idx] = pts[idx]*s;
 
-	area = DBL_MAX;	// update
+	// the angles do not change
+	area *= (double)s*s;
+	maxSideLength *= s;
+	bbUc = bbUc*s;
+	bbLc = bbLc*s;
+
+	// negative scales swap the bbox corners
+	if (s < 0)
+		std::swap(bbUc, bbLc);
+}
+
+void DkPolyRect::translate(const nmc::DkVector& offset) {
+
+	for (int idx = 0; idx < numPts; idx++)
+		pts[idx] = pts[idx] + offset;
+
+	// the shape does not change
+	bbUc = bbUc + offset;
+	bbLc = bbLc + offset;
+}
+
+/**
+* Returns the orientation of the rectangle's sides in degrees [0 90).
+**/
+double DkPolyRect::orientation() const {
+
+	if (numPts < 2)
+		return 0.0;
+
+	std::vector<cv::Point2f> cvPts;
+	for (int idx = 0; idx < numPts; idx++)
+		cvPts.push_back(cv::Point2f(pts[idx].x, pts[idx].y));
+
+	double angle = std::fmod((double)cv::minAreaRect(cvPts).angle, 90.0);
+
+	return angle < 0 ? angle + 90.0 : angle;
 }
 
 void DkPolyRect::scaleCenter(float s) {
 
 	nmc::DkVector c = center();
 
-	for (size_t idx = 0; idx < pts.size(); idx++) {
+	for (int idx = 0; idx < numPts; idx++) {
 		pts[idx] = nmc::DkVector(pts[idx]-c)*s+c;
 	}
 
-	area = DBL_MAX;	// update
+	updateGeometry();
 }
 
 nmc::DkVector DkPolyRect::center() const {
 
 	nmc::DkVector c;
 
-	for (size_t idx = 0; idx < pts.size(); idx++)
+	for (int idx = 0; idx < numPts; idx++)
 		c += pts[idx];
 
-	c /= (float)pts.size();
+	c /= (float)numPts;
 
 	return c;
 }
@@ -293,10 +534,10 @@ bool DkPolyRect::inside(const nmc::DkVector& vec) const {
 	// we assume, that the polygon is convex
 	// so if the point has a different scalar product
 	// for one side of the polygon - it is not inside
-	for (size_t idx = 1; idx < pts.size()+1; idx++) {
+	for (int idx = 1; idx < numPts+1; idx++) {
 
-		nmc::DkVector dv(pts[idx-1] - pts[idx%pts.size()]);
-		float csign = dv.scalarProduct(vec - pts[idx%pts.size()]);
+		nmc::DkVector dv(pts[idx-1] - pts[idx%numPts]);
+		float csign = dv.scalarProduct(vec - pts[idx%numPts]);
 
 		if (lastsign*csign < 0) {
 			return false;
@@ -310,37 +551,36 @@ bool DkPolyRect::inside(const nmc::DkVector& vec) const {
 
 float DkPolyRect::maxSide() const {
 
-	float ms = 0;
-
-	for (size_t idx = 1; idx < pts.size()+1; idx++) {
-		float cs = nmc::DkVector(pts[idx-1] - pts[idx%pts.size()]).norm();
-
-		if (ms < cs)
-			ms = cs;
-	}
-
-	return ms;
+	return maxSideLength;
 }
 
 double DkPolyRect::getArea() {
 
-	if (area == DBL_MAX)
-		area = abs(intersectArea(*this));
-
 	return area;
 }
 
 double DkPolyRect::getAreaConst() const {
 
-	if (area == DBL_MAX)
-		return abs(intersectArea(*this));
-
 	return area;
 }
 
 bool DkPolyRect::compArea(const DkPolyRect& pl, const DkPolyRect& pr) {
 
-	return pl.getAreaConst() < pr.getAreaConst();
+	return pl.area < pr.area;
+}
+
+/**
+* Sets the channel and threshold level that found the rect.
+**/
+void DkPolyRect::setOrigin(int channel, int level) {
+
+	originChannel = channel;
+	originLevel = level;
+}
+
+void DkPolyRect::setConfidence(const DkPageConfidence& confidence) {
+
+	this->confidence = confidence;
 }
 
 nmc::DkRotatingRect DkPolyRect::toRotatingRect() const {
@@ -349,7 +589,9 @@ nmc::DkRotatingRect DkPolyRect::toRotatingRect() const {
 		return nmc::DkRotatingRect();
 
 	// find the largest rectangle
-	std::vector<cv::Point> largeRect = toCvPoints();
+	std::vector<cv::Point2f> largeRect;
+	for (int idx = 0; idx < numPts; idx++)
+		largeRect.push_back(cv::Point2f(pts[idx].x, pts[idx].y));
 
 	cv::RotatedRect rect = cv::minAreaRect(largeRect);
 
@@ -384,32 +626,21 @@ void DkPolyRect::draw(cv::Mat& img, const cv::Scalar& col) const {
 }
 
 std::vector<nmc::DkVector> DkPolyRect::getCorners() const {
-	return pts;
+	return std::vector<nmc::DkVector>(pts, pts+numPts);
 }
 
 DkBox DkPolyRect::getBBox() const {
 
-	nmc::DkVector uc(FLT_MAX, FLT_MAX), lc(-FLT_MAX, -FLT_MAX);
-
-	for (size_t idx = 0; idx < pts.size(); idx++) {
-
-		uc = uc.minVec(pts[idx]);
-		lc = lc.maxVec(pts[idx]);
-	}
-
-
-	if (pts.empty())
+	if (empty())
 		qDebug() << "bbox of empty poly rect requested!!";
 
-	DkBox box(uc, lc-uc);
-
-	return box;
+	return DkBox(bbUc, bbLc-bbUc);
 }
 
 std::vector<cv::Point> DkPolyRect::toCvPoints() const {
 
 	std::vector<cv::Point> cvPts;
-	for (int idx = 0; idx < (int)pts.size(); idx++) {
+	for (int idx = 0; idx < numPts; idx++) {
 		cvPts.push_back(pts[idx].getCvPoint());
 	}
 
@@ -420,32 +651,286 @@ QPolygonF DkPolyRect::toPolygon() const {
 
 	QPolygonF poly;
 
-	for (const nmc::DkVector& v : pts) {
-		poly.append(v.toQPointF());
+	for (int idx = 0; idx < numPts; idx++) {
+		poly.append(pts[idx].toQPointF());
 	}
 
 	return poly;
 }
 
-void PageExtractor::findPage(cv::Mat img, float scale, std::vector<DkPolyRect>& rects) {
+// DkRectGrid --------------------------------------------------------------------
+DkRectGrid::DkRectGrid(const std::vector<DkPolyRect>& rects) {
+
+	if (rects.empty())
+		return;
+
+	nmc::DkVector uc(FLT_MAX, FLT_MAX), lc(-FLT_MAX, -FLT_MAX);
+
+	boxes.reserve(rects.size());
+	for (const DkPolyRect& r : rects) {
+
+		DkBox b = r.getBBox();
+		uc = uc.minVec(b.uc);
+		lc = lc.maxVec(b.lc);
+		boxes.push_back(b);
+	}
+
+	// ~ sqrt(n) cells per side
+	int numCells = qBound(1, cvCeil(std::sqrt((double)rects.size())), 64);
+	numCols = numCells;
+	numRows = numCells;
+
+	origin = uc;
+	cellSize = lc-uc;
+	cellSize.x = std::max(cellSize.x / numCols, 1.0f);
+	cellSize.y = std::max(cellSize.y / numRows, 1.0f);
+
+	cells.resize(numCols*numRows);
+
+	for (int idx = 0; idx < (int)boxes.size(); idx++) {
+
+		int c0, r0, c1, r1;
+		cellRange(boxes[idx], c0, r0, c1, r1);
+
+		for (int r = r0; r <= r1; r++) {
+			for (int c = c0; c <= c1; c++)
+				cells[r*numCols+c].push_back(idx);
+		}
+	}
+}
+
+/**
+* Returns the indexes of all rectangles whose bounding box overlaps box.
+* @param box the query box.
+* @param indexes the indexes in ascending order.
+**/
+void DkRectGrid::query(const DkBox& box, std::vector<int>& indexes) const {
+
+	indexes.clear();
+
+	if (cells.empty())
+		return;
+
+	int c0, r0, c1, r1;
+	cellRange(box, c0, r0, c1, r1);
+
+	for (int r = r0; r <= r1; r++) {
+		for (int c = c0; c <= c1; c++) {
+
+			for (int idx : cells[r*numCols+c]) {
+				if (overlaps(box, boxes[idx]))
+					indexes.push_back(idx);
+			}
+		}
+	}
+
+	// rects that span several cells are found multiple times
+	std::sort(indexes.begin(), indexes.end());
+	indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+}
+
+void DkRectGrid::cellRange(const DkBox& box, int& c0, int& r0, int& c1, int& r1) const {
+
+	c0 = qBound(0, (int)std::floor((box.uc.x - origin.x) / cellSize.x), numCols-1);
+	r0 = qBound(0, (int)std::floor((box.uc.y - origin.y) / cellSize.y), numRows-1);
+	c1 = qBound(0, (int)std::floor((box.lc.x - origin.x) / cellSize.x), numCols-1);
+	r1 = qBound(0, (int)std::floor((box.lc.y - origin.y) / cellSize.y), numRows-1);
+}
+
+bool DkRectGrid::overlaps(const DkBox& a, const DkBox& b) {
+
+	return a.uc.x <= b.lc.x && b.uc.x <= a.lc.x &&
+		a.uc.y <= b.lc.y && b.uc.y <= a.lc.y;
+}
+
+// DkSegmentationStats --------------------------------------------------------------------
+DkSegmentationStats::DkSegmentationStats() {
+	clear();
+}
+
+DkSegmentationStats::DkSegmentationStats(const DkSegmentationStats& other) {
+	*this = other;
+}
+
+DkSegmentationStats& DkSegmentationStats::operator=(const DkSegmentationStats& other) {
+
+	for (int idx = 0; idx < stage_end; idx++)
+		ticks[idx] = other.ticks[idx].load();
+	for (int idx = 0; idx < max_levels; idx++)
+		levelTicks[idx] = other.levelTicks[idx].load();
+	for (int idx = 0; idx < count_end; idx++)
+		counters[idx] = other.counters[idx].load();
+
+	return *this;
+}
+
+void DkSegmentationStats::clear() {
+
+	for (std::atomic<int64>& t : ticks)
+		t = 0;
+	for (std::atomic<int64>& t : levelTicks)
+		t = 0;
+	for (std::atomic<int64>& c : counters)
+		c = 0;
+}
+
+void DkSegmentationStats::addTicks(Stage stage, int64 t) {
+	ticks[stage] += t;
+}
+
+void DkSegmentationStats::addLevelTicks(int level, int64 t) {
+	levelTicks[std::min(std::max(level, 0), (int)max_levels-1)] += t;
+}
+
+void DkSegmentationStats::add(Counter counter, int64 val) {
+	counters[counter] += val;
+}
+
+/**
+* Returns the time of a stage in ms.
+**/
+double DkSegmentationStats::time(Stage stage) const {
+	return ticks[stage].load()/cv::getTickFrequency()*1000.0;
+}
+
+/**
+* Returns the time of a threshold level (contours & filtering included) in ms.
+**/
+double DkSegmentationStats::levelTime(int level) const {
+
+	if (level < 0 || level >= max_levels)
+		return 0;
+
+	return levelTicks[level].load()/cv::getTickFrequency()*1000.0;
+}
+
+int64 DkSegmentationStats::count(Counter counter) const {
+	return counters[counter].load();
+}
+
+/**
+* Returns all stages and counters that are not zero.
+**/
+QString DkSegmentationStats::toString() const {
+
+	QString str;
+
+	for (int idx = 0; idx < stage_end; idx++) {
+		if (ticks[idx].load())
+			str += stageName((Stage)idx) + ": " + QString::number(time((Stage)idx), 'f', 1) + " ms, ";
+	}
+
+	for (int idx = 0; idx < count_end; idx++) {
+		if (counters[idx].load())
+			str += counterName((Counter)idx) + ": " + QString::number(counters[idx].load()) + ", ";
+	}
+
+	str.chop(2);
+
+	return str;
+}
+
+QString DkSegmentationStats::stageName(Stage stage) {
+
+	switch (stage) {
+	case stage_resize:				return "resize";
+	case stage_channels:			return "channels";
+	case stage_canny:				return "canny";
+	case stage_threshold:			return "threshold";
+	case stage_contours:			return "findContours";
+	case stage_approx:				return "approxPolyDP";
+	case stage_filter_duplicates:	return "filterDuplicates";
+	case stage_refine:				return "refine corners";
+	case stage_confidence:			return "confidence";
+	case stage_tracking:			return "tracking";
+	case stage_background:			return "background";
+	case stage_hough:				return "hough";
+	case stage_segments:			return "line segments";
+	case stage_peaks:				return "EP/IP";
+	case stage_rectangles:			return "rectangles";
+	default:						return "unknown";
+	}
+}
+
+QString DkSegmentationStats::counterName(Counter counter) {
+
+	switch (counter) {
+	case count_levels:				return "levels";
+	case count_contours:			return "contours";
+	case count_candidates:			return "candidates";
+	case count_kept:				return "kept";
+	case count_hough_lines:			return "hough lines";
+	case count_segments:			return "line segments";
+	case count_extended_peaks:		return "EPs";
+	case count_intermediate_peaks:	return "IPs";
+	case count_rectangles:			return "rectangles";
+	case count_reject_points:		return "rejected (points)";
+	case count_reject_bbox:			return "rejected (bbox area)";
+	case count_reject_border:		return "rejected (border)";
+	case count_reject_vertices:		return "rejected (vertices)";
+	case count_reject_area:			return "rejected (area)";
+	case count_reject_convex:		return "rejected (convexity)";
+	case count_reject_shape:		return "rejected (angles)";
+	default:						return "unknown";
+	}
+}
+
+// DkStageTimer --------------------------------------------------------------------
+DkStageTimer::DkStageTimer(DkSegmentationStats* stats, DkSegmentationStats::Stage stage) : stats(stats), stage(stage) {
+	start = stats ? cv::getTickCount() : 0;
+}
+
+DkStageTimer::~DkStageTimer() {
+	stop();
+}
+
+/**
+* Adds the time measured so far - later calls have no effect.
+**/
+void DkStageTimer::stop() {
+
+	if (stats)
+		stats->addTicks(stage, cv::getTickCount()-start);
+
+	stats = 0;
+}
+
+void PageExtractor::findPage(cv::Mat img, float scale, std::vector<DkPolyRect>& rects, DkSegmentationStats* stats) {
 	cv::Mat gray, bw;
 
-	cv::cvtColor(img, gray, CV_RGB2GRAY);
-	if (scale != 1.0f) {
-		cv::resize(gray, gray, cv::Size(), scale, scale, CV_INTER_AREA);	// inter nn -> assuming resize to be 1/(2^n)
+	{
+		DkStageTimer st(stats, DkSegmentationStats::stage_resize);
+
+		// downscale first - the full resolution image is read once and never copied
+		cv::Mat sImg = img;
+		if (scale != 1.0f)
+			cv::resize(img, sImg, cv::Size(), scale, scale, CV_INTER_AREA);	// inter nn -> assuming resize to be 1/(2^n)
+
+		if (sImg.channels() == 1)
+			sImg.copyTo(gray);	// img may wrap the caller's buffer
+		else
+			cv::cvtColor(sImg, gray, CV_RGB2GRAY);
 	}
 	const int smallerSide = std::min(gray.size().width, gray.size().height);
 	
-	cv::equalizeHist(gray, gray);
-	bw = removeText(gray, 2.0f, 5, 2);
-//	cv::imshow("bw after removeText", bw);
-//	cv::waitKey(0);
+	std::vector<HoughLine> lines;
+	{
+		DkStageTimer st(stats, DkSegmentationStats::stage_hough);
+
+		cv::equalizeHist(gray, gray);
+		bw = removeText(gray, 2.0f, 5, 2);
+	//	cv::imshow("bw after removeText", bw);
+	//	cv::waitKey(0);
 	
-	cv::dilate(bw, bw, cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3, 3)));
+		cv::dilate(bw, bw, cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3, 3)));
 	
-	cv::Mat lineImg;
-	int accMin = (int)(houghPeakThresholdRel * std::min(bw.size().width, bw.size().height));
-	std::vector<HoughLine> lines = houghTransform(bw, 1, (float)(CV_PI / 180.0), accMin, maxLinesHough);
+		int accMin = (int)(houghPeakThresholdRel * std::min(bw.size().width, bw.size().height));
+		lines = houghTransform(bw, 1, (float)(CV_PI / 180.0), accMin, maxLinesHough);
+	}
+
+	if (stats)
+		stats->add(DkSegmentationStats::count_hough_lines, lines.size());
+
 	if (lines.empty()) {
 		qDebug() << "no hough lines detected";
 		return;
@@ -453,12 +938,22 @@ void PageExtractor::findPage(cv::Mat img, float scale, std::vector<DkPolyRect>&
 	
 	// find line segments in image
 	int maxGapLength = (int)(maxGapLengthRel * smallerSide);
-	std::vector<LineSegment> lineSegments = findLineSegments(bw, lines, minLineSegmentLength, maxGapLength);
+	std::vector<LineSegment> lineSegments;
+	{
+		DkStageTimer st(stats, DkSegmentationStats::stage_segments);
+		lineSegments = findLineSegments(bw, lines, minLineSegmentLength, maxGapLength);
+	}
+
+	if (stats)
+		stats->add(DkSegmentationStats::count_segments, lineSegments.size());
+
 	if (lineSegments.empty()) {
 		qDebug() << "findLineSegments has not found any line segments, even though hough lines were detected.";
 		return;
 	}
 	
+	DkStageTimer peakTimer(stats, DkSegmentationStats::stage_peaks);
+
 	// 4.3 transform domain peak filtering
 	// iterate through all pairs of lines and build pairs of parallel line segments called extended peak pairs (EPs)
 	std::vector<ExtendedPeak> EPs;
@@ -492,6 +987,15 @@ void PageExtractor::findPage(cv::Mat img, float scale, std::vector<DkPolyRect>&
 			}
 		}
 	}
+
+	peakTimer.stop();
+
+	if (stats) {
+		stats->add(DkSegmentationStats::count_extended_peaks, EPs.size());
+		stats->add(DkSegmentationStats::count_intermediate_peaks, IPs.size());
+	}
+
+	DkStageTimer rectTimer(stats, DkSegmentationStats::stage_rectangles);
 	
 	// test IP corners
 	std::vector<Rectangle> candidates;
@@ -562,6 +1066,9 @@ void PageExtractor::findPage(cv::Mat img, float scale, std::vector<DkPolyRect>&
 		r.scale(1.0f / scale);
 		rects.push_back(r);
 	}
+
+	if (stats)
+		stats->add(DkSegmentationStats::count_rectangles, rectangles.size());
 }
 
 float PageExtractor::pointToLineDistance(LineSegment ls, cv::Point2f p) {
@@ -30,6 +30,8 @@
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc_c.h>
 #include <QString>
+
+#include <atomic>
 #pragma warning(pop)		// no warnings from includes - end
 
 namespace nmp {
@@ -420,15 +422,64 @@ private:
 	void computeBoundingBox(std::vector<nmc::DkVector> vec, nmc::DkVector *minRange, nmc::DkVector *maxRange);
 };
 
-// data class
+/**
+* Intersection of two convex polygons with few vertices.
+* The polygons are clipped on the stack (Sutherland-Hodgman), hence
+* nothing is allocated. For convex quads, this is considerably faster than
+* DkIntersectPoly which remains the fallback for arbitrary polygons.
+**/
+class DkIntersectConvex {
+
+public:
+	enum {
+		max_vertices = 8	// input polygons must not have more vertices
+	};
+
+	static double compute(const nmc::DkVector* a, int na, const nmc::DkVector* b, int nb);
+	static bool isConvex(const nmc::DkVector* pts, int n);
+
+protected:
+	struct Point {
+		double x;
+		double y;
+	};
+
+	static double area(const Point* pts, int n);
+};
+
+/**
+* Quality measures of a detected page.
+* score combines them to a confidence in [0 1].
+**/
+struct DkPageConfidence {
+	double edgeSupport = 0;		// fraction of the sides supported by image edges [0 1]
+	double maxCosine = 1;		// maximal cosine of the corner angles
+	int numLevels = 0;			// number of threshold levels that found the page
+	int numChannels = 0;		// number of color channels that found the page
+	double areaRatio = 0;		// page area / image area
+	double score = 0;			// combined confidence [0 1]
+};
+
+/**
+* A convex quadrilateral (e.g. a page).
+* The corners are stored inline and the geometry needed for filtering
+* (area, bbox, max side, max cosine) is computed once. Hence, copying and
+* sorting rects does not allocate or recompute anything.
+**/
 class DkPolyRect {
 
 public:
+	enum {
+		max_corners = 4
+	};
+
 	//DkPolyRect(nmc::DkVector p1, nmc::DkVector p2, nmc::DkVector p3, nmc::DkVector p4);
 	DkPolyRect(const std::vector<cv::Point>& pts = std::vector<cv::Point>());
 	DkPolyRect(const std::vector<nmc::DkVector>& pts);
 
 	bool empty() const;
+	int size() const;
+	const nmc::DkVector& corner(int idx) const;
 	double getMaxCosine() const { return maxCosine; };
 	void draw(cv::Mat& img, const cv::Scalar& col = cv::Scalar(0, 100, 255)) const;
 	std::vector<cv::Point> toCvPoints() const;
@@ -436,31 +487,171 @@ public:
 	std::vector<nmc::DkVector> getCorners() const;
 	DkBox getBBox() const;
 	double intersectArea(const DkPolyRect& pr) const;
+	void intersectAreas(const std::vector<DkPolyRect>& rects, std::vector<double>& areas) const;
+	bool isConvex() const;
 	double getArea();
 	double getAreaConst() const;
 	void scale(float s);
 	void scaleCenter(float s);
+	void translate(const nmc::DkVector& offset);
+	double orientation() const;
 	bool inside(const nmc::DkVector& vec) const;
 	float maxSide() const;
 	nmc::DkVector center() const;
 	static bool compArea(const DkPolyRect& pl, const DkPolyRect& pr);
 	nmc::DkRotatingRect toRotatingRect() const;
 
-protected:
-	std::vector<nmc::DkVector> pts;
-	double maxCosine;
-	double area;
+	void setOrigin(int channel, int level);
+	int getChannel() const { return originChannel; };
+	int getLevel() const { return originLevel; };
+	void setConfidence(const DkPageConfidence& confidence);
+	const DkPageConfidence& getConfidence() const { return confidence; };
 
-	void toDkVectors(const std::vector<cv::Point>& pts, std::vector<nmc::DkVector>& dkPts) const;
+protected:
+	nmc::DkVector pts[max_corners];
+	int numPts = 0;
+
+	// detection
+	int originChannel = -1;		// swept channel that found the rect (-1: Bhaskar)
+	int originLevel = -1;		// threshold level that found the rect (-1: Bhaskar)
+	DkPageConfidence confidence;
+
+	// cached geometry
+	double maxCosine = 0;
+	double area = 0;
+	float maxSideLength = 0;
+	bool convex = false;
+	nmc::DkVector bbUc;		// upper left corner of the bbox
+	nmc::DkVector bbLc;		// lower right corner of the bbox
+
+	void updateGeometry();
 	void computeMaxCosine();
 };
 
+/**
+* Uniform grid of rectangle bounding boxes.
+* It finds rectangles whose bounding boxes overlap a query box
+* without testing all rectangles.
+**/
+class DkRectGrid {
+
+public:
+	DkRectGrid(const std::vector<DkPolyRect>& rects);
+
+	void query(const DkBox& box, std::vector<int>& indexes) const;
+
+protected:
+	std::vector<std::vector<int> > cells;
+	std::vector<DkBox> boxes;
+	nmc::DkVector origin;
+	nmc::DkVector cellSize;
+	int numCols = 1;
+	int numRows = 1;
+
+	void cellRange(const DkBox& box, int& c0, int& r0, int& c1, int& r1) const;
+	static bool overlaps(const DkBox& a, const DkBox& b);
+};
+
+/**
+* Stage timers and counters of the page segmentation.
+* Stages that run concurrently accumulate the time of all threads. Recording
+* costs two tick counts per stage and atomic additions only - hence, it is always on.
+**/
+class DkSegmentationStats {
+
+public:
+	enum Stage {
+		stage_resize = 0,
+		stage_channels,
+		stage_canny,
+		stage_threshold,
+		stage_contours,
+		stage_approx,
+		stage_filter_duplicates,
+		stage_refine,
+		stage_confidence,
+		stage_tracking,
+		stage_background,
+		stage_hough,			// PageExtractor
+		stage_segments,
+		stage_peaks,
+		stage_rectangles,
+
+		stage_end
+	};
+
+	enum Counter {
+		count_levels = 0,
+		count_contours,
+		count_candidates,
+		count_kept,
+		count_hough_lines,
+		count_segments,
+		count_extended_peaks,
+		count_intermediate_peaks,
+		count_rectangles,
+		count_reject_points,		// contour rejections (see DkPageSegmentation::filterContours)
+		count_reject_bbox,
+		count_reject_border,
+		count_reject_vertices,
+		count_reject_area,
+		count_reject_convex,
+		count_reject_shape,
+
+		count_end
+	};
+
+	enum {
+		max_levels = 64		// threshold levels with an own timer - higher levels are added to the last
+	};
+
+	DkSegmentationStats();
+	DkSegmentationStats(const DkSegmentationStats& other);
+	DkSegmentationStats& operator=(const DkSegmentationStats& other);
+
+	void clear();
+	void addTicks(Stage stage, int64 ticks);
+	void addLevelTicks(int level, int64 ticks);
+	void add(Counter counter, int64 val = 1);
+
+	double time(Stage stage) const;
+	double levelTime(int level) const;
+	int64 count(Counter counter) const;
+	QString toString() const;
+
+	static QString stageName(Stage stage);
+	static QString counterName(Counter counter);
+
+protected:
+	std::atomic<int64> ticks[stage_end];
+	std::atomic<int64> levelTicks[max_levels];
+	std::atomic<int64> counters[count_end];
+};
+
+/**
+* Adds the time of its scope to a stage.
+* Nothing is measured if no stats are given.
+**/
+class DkStageTimer {
+
+public:
+	DkStageTimer(DkSegmentationStats* stats, DkSegmentationStats::Stage stage);
+	~DkStageTimer();
+
+	void stop();
+
+protected:
+	DkSegmentationStats* stats;
+	DkSegmentationStats::Stage stage;
+	int64 start;
+};
+
 class PageExtractor {
 	
 public:
 	PageExtractor() {}
 	
-	void findPage(cv::Mat img, float scale, std::vector<DkPolyRect>& rects);
+	void findPage(cv::Mat img, float scale, std::vector<DkPolyRect>& rects, DkSegmentationStats* stats = 0);
 	
 protected:
 	const int maxLinesHough = 30;